@@ -36,15 +36,27 @@
 /**
 * @function CThreadpool
 * @brief CThreadpool's constructor
-* @param num Number of worker threads.
+* @param num Maximum number of worker threads.
+* @param attr Attributes of worker threads.
 * @return 
 */
-CThreadpool::CThreadpool(int num)
+CThreadpool::CThreadpool(int num, const CThreadAttr &attr)
 {
     assert(num > 0);
     threadNum_ = num;
+    startedNum_ = 0;
+    idleNum_ = 0;
     isRunning_ = true;
     threads_ = NULL;
+    threadAttr_ = attr;
+    admission_ = kAdmitAll;
+    targetUs_ = 0;
+    intervalUs_ = 0;
+    firstAboveUs_ = 0;
+    overloaded_ = false;
+    ewmaRunNs_ = 0;
+    codelShed_ = 0;
+    deadlineShed_ = 0;
 
     if(createThread() < 0){
         std::cerr << "createThread error!" << std::endl;
@@ -64,14 +76,22 @@ CThreadpool::~CThreadpool()
 
 /**
 * @function createThread
-* @brief create threadNum_ worker threads
+* @brief prepare resources for at most threadNum_ worker threads,
+*        the threads themselves are created lazily by add
 * @return 0 if succeed, -1 on failed
 */
 int CThreadpool::createThread()
 {
-    int i;
     pthread_mutex_init(&lock_, NULL);
     pthread_cond_init(&notify_, NULL);
+    pthread_attr_init(&attr_);
+
+    if(threadAttr_.stackSize != 0 && pthread_attr_setstacksize(&attr_, threadAttr_.stackSize) != 0){
+        std::cerr << "pthread_attr_setstacksize error! use default stack size" << std::endl;
+    }
+    if(threadAttr_.guardSize != 0 && pthread_attr_setguardsize(&attr_, threadAttr_.guardSize) != 0){
+        std::cerr << "pthread_attr_setguardsize error! use default guard size" << std::endl;
+    }
 
     threads_ = (pthread_t*)malloc(sizeof(pthread_t) * threadNum_);
     if(threads_ == NULL){
@@ -79,13 +99,30 @@ int CThreadpool::createThread()
         return -1;
     }
 
-    for(i = 0; i < threadNum_; ++i){
-        if(pthread_create(&threads_[i], NULL, threadFunc, this) != 0){
-            std::cerr << "pthread_create error!" << std::endl;
-            return -1;
-        }
+    return 0;
+}
+
+/**
+* @function spawnThread
+* @brief create one more worker thread, must be called with lock_ held
+* @return 0 if succeed, -1 on failed
+*/
+int CThreadpool::spawnThread()
+{
+    assert(threads_ != NULL && startedNum_ < threadNum_);
+    if(pthread_create(&threads_[startedNum_], &attr_, threadFunc, this) != 0){
+        std::cerr << "pthread_create error!" << std::endl;
+        return -1;
     }
 
+    if(!threadAttr_.name.empty()){
+        //线程名最长15字节
+        char name[16];
+        snprintf(name, sizeof(name), "%s-%d", threadAttr_.name.c_str(), startedNum_);
+        pthread_setname_np(threads_[startedNum_], name);
+    }
+    ++startedNum_;
+
     return 0;
 }
 
@@ -107,18 +144,43 @@ const int CThreadpool::size()
 * @function add
 * @brief add task to task queue
 * @param task pointer to task which is added to task queue
-* @return 0 if succeed, -1 if failed
+* @param deadlineUs deadline used by kPredictive, -1 means the target set by setAdmission
+* @return 0 if succeed, kStopped if the threadpool has stopped, kRejected if shed by admission control
 */
-int CThreadpool::add(const Task &task)
+int CThreadpool::add(const Task &task, long long deadlineUs)
 {
     //检查线程池是否已经停止
     pthread_mutex_lock(&lock_);
     if(!isRunning_){
-        return -1;
+        pthread_mutex_unlock(&lock_);
+        return kStopped;
     }
 
-    //否则继续向线程池添加任务
-    queue_.push_back(task);
+    //准入控制
+    if(admission_ == kCoDel && overloaded_){
+        ++codelShed_;
+        pthread_mutex_unlock(&lock_);
+        return kRejected;
+    }
+    if(admission_ == kPredictive){
+        long long limit = (deadlineUs < 0 ? targetUs_ : deadlineUs);
+        if(ewmaRunNs_ * static_cast<long long>(queue_.size()) / threadNum_ > limit * 1000){
+            ++deadlineShed_;
+            pthread_mutex_unlock(&lock_);
+            return kRejected;
+        }
+    }
+
+    //没有空闲的工作线程时再创建新线程, 创建失败且没有任何工作线程则拒绝任务
+    if(queue_.size() >= static_cast<size_t>(idleNum_) && startedNum_ < threadNum_){
+        if(spawnThread() < 0 && startedNum_ == 0){
+            pthread_mutex_unlock(&lock_);
+            return kStopped;
+        }
+    }
+
+    //否则继续向线程池添加任务, 总是记录入队时间, 开启kCoDel前已入队的任务才有正确的逗留时间
+    queue_.push_back(std::make_pair(task, nowUs()));
     //发送消息
     pthread_cond_signal(&notify_);
     pthread_mutex_unlock(&lock_);
@@ -140,7 +202,7 @@ void CThreadpool::stop()
     isRunning_ = false;
     pthread_cond_broadcast(&notify_);
     //thread_join
-    for(i = 0; i < threadNum_; ++i){
+    for(i = 0; i < startedNum_; ++i){
         pthread_join(threads_[i], NULL);
     }
 
@@ -150,22 +212,26 @@ void CThreadpool::stop()
 
     pthread_mutex_destroy(&lock_);
     pthread_cond_destroy(&notify_);
+    pthread_attr_destroy(&attr_);
 }
 
 
 /**
 * @function take
 * @brief take the task from threadpool
+* @param predictive if not NULL, set to whether kPredictive is on, read under lock_ together with the task
 * @return the pointer to task
 */
-Task CThreadpool::take()
+Task CThreadpool::take(bool *predictive)
 {
     Task task;
     while(!task){
         pthread_mutex_lock(&lock_);
+        ++idleNum_;
         while(queue_.empty() && isRunning_){
             pthread_cond_wait(&notify_, &lock_);
         }
+        --idleNum_;
 
         if(!isRunning_){
             pthread_mutex_unlock(&lock_);
@@ -175,9 +241,27 @@ Task CThreadpool::take()
             continue;
         }
 
-        task = queue_.front();
+        task = queue_.front().first;
+        long long enqueuedUs = queue_.front().second;
         queue_.pop_front();
         assert(task != NULL);
+
+        //更新CoDel状态
+        if(admission_ == kCoDel){
+            long long now = nowUs();
+            if(now - enqueuedUs < targetUs_ || queue_.empty()){
+                //逗留时间回到target以下或队列已排空, 退出过载状态
+                firstAboveUs_ = 0;
+                overloaded_ = false;
+            }else if(firstAboveUs_ == 0){
+                firstAboveUs_ = now + intervalUs_;
+            }else if(now >= firstAboveUs_){
+                overloaded_ = true;
+            }
+        }
+        if(predictive != NULL){
+            *predictive = (admission_ == kPredictive);
+        }
         pthread_mutex_unlock(&lock_);
     }
     return task;
@@ -193,15 +277,106 @@ void *CThreadpool::threadFunc(void * args)
 {
     CThreadpool *pool = static_cast<CThreadpool*>(args);
     while(pool->isRunning_){
-        Task task = pool->take();
+        bool predictive = false;
+        Task task = pool->take(&predictive);
         if(!task){
             printf("thread %ld exit\n", pthread_self());
             break;
         }
 
         assert(task != NULL);
-        task();
+        if(predictive){
+            long long start = nowNs();
+            task();
+            pool->recordRunTime(nowNs() - start);
+        }else{
+            task();
+        }
     }
 
     return NULL;
+}
+
+/**
+* @function setAdmission
+* @brief set admission control of add
+* @param mode admission mode
+* @param targetUs sojourn target of kCoDel, or default deadline of kPredictive
+* @param intervalUs how long the sojourn time must stay above target before kCoDel sheds tasks
+*/
+void CThreadpool::setAdmission(AdmissionMode mode, long long targetUs, long long intervalUs)
+{
+    pthread_mutex_lock(&lock_);
+    admission_ = mode;
+    targetUs_ = targetUs;
+    intervalUs_ = intervalUs;
+    firstAboveUs_ = 0;
+    overloaded_ = false;
+    pthread_mutex_unlock(&lock_);
+}
+
+/**
+* @function codelShed
+* @brief return number of tasks rejected by kCoDel
+* @return number of tasks rejected by kCoDel
+*/
+size_t CThreadpool::codelShed()
+{
+    pthread_mutex_lock(&lock_);
+    size_t n = codelShed_;
+    pthread_mutex_unlock(&lock_);
+    return n;
+}
+
+/**
+* @function deadlineShed
+* @brief return number of tasks rejected by kPredictive
+* @return number of tasks rejected by kPredictive
+*/
+size_t CThreadpool::deadlineShed()
+{
+    pthread_mutex_lock(&lock_);
+    size_t n = deadlineShed_;
+    pthread_mutex_unlock(&lock_);
+    return n;
+}
+
+/**
+* @function recordRunTime
+* @brief update EWMA of task run time, alpha = 1/8
+* @param ns run time of the last task in nanoseconds
+*/
+void CThreadpool::recordRunTime(long long ns)
+{
+    //至少记为1ns, 0留作"尚无样本"
+    if(ns <= 0){
+        ns = 1;
+    }
+    pthread_mutex_lock(&lock_);
+    ewmaRunNs_ = (ewmaRunNs_ == 0 ? ns : ewmaRunNs_ + (ns - ewmaRunNs_) / 8);
+    pthread_mutex_unlock(&lock_);
+}
+
+/**
+* @function nowUs
+* @brief return monotonic time
+* @return monotonic time in microseconds
+*/
+long long CThreadpool::nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+* @function nowNs
+* @brief return monotonic time
+* @return monotonic time in nanoseconds
+*/
+long long CThreadpool::nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
\ No newline at end of file
@@ -43,32 +43,76 @@
 #include <sys/types.h>
 #include <malloc.h>
 #include <functional>
+#include <time.h>
 
 typedef std::function<void()> Task;
 
-//线程池类
+//工作线程属性, 0或空串表示使用系统默认值
+struct CThreadAttr
+{
+    CThreadAttr():stackSize(0), guardSize(0){}
+
+    size_t stackSize;                               //线程栈大小
+    size_t guardSize;                               //栈溢出保护区大小
+    std::string name;                               //线程名前缀, 实际名为"name-序号", 超过15字节截断
+};
+
+//过载时的准入控制方式
+enum AdmissionMode
+{
+    kAdmitAll,          //不做准入控制
+    kCoDel,             //任务在队列中的逗留时间在整个interval内都超过target时拒绝新任务
+    kPredictive         //按 平均执行时间*队列长度/工作线程数 估计等待时间, 超过任务的deadline时拒绝
+};
+
+//线程池类, 工作线程在提交任务时按需创建, 最多threadNum_个
 class CThreadpool
 {
 public:
-    CThreadpool(int num = 10);
+    enum
+    {
+        kStopped = -1,                              //add: 线程池已停止
+        kRejected = -2                              //add: 被准入控制拒绝
+    };
+public:
+    CThreadpool(int num = 10, const CThreadAttr &attr = CThreadAttr());
     ~CThreadpool();
 public:
     const int size();
     void stop();
-    int add(const Task &task);
-    Task take();
+    int add(const Task &task, long long deadlineUs = -1);
+    Task take(bool *predictive = NULL);
+    void setAdmission(AdmissionMode mode, long long targetUs, long long intervalUs = 100000);
+    size_t codelShed();
+    size_t deadlineShed();
 private:
     int createThread();
+    int spawnThread();
+    void recordRunTime(long long ns);
+    static long long nowUs();
+    static long long nowNs();
     //工作线程
     static void *threadFunc(void *);
 private:
     CThreadpool &operator=(const CThreadpool &);    //Effective C++ Item 6
     CThreadpool(const CThreadpool &);               //Effective C++ Item 6
 private:
-    int threadNum_;                                 //工作线程数
+    int threadNum_;                                 //工作线程数上限
+    int startedNum_;                                //已创建的工作线程数
+    int idleNum_;                                   //正在等待任务的工作线程数
     int isRunning_;                                 //线程池运行与停止状态
     pthread_t *threads_;                            //工作线程的pthread_t id
-    std::deque<Task> queue_;                      //任务队列
+    CThreadAttr threadAttr_;                        //工作线程属性
+    pthread_attr_t attr_;                           //由threadAttr_生成的pthread属性
+    std::deque<std::pair<Task, long long> > queue_; //任务队列, 附带入队时间
+    AdmissionMode admission_;                       //准入控制方式, 以下状态均由lock_保护
+    long long targetUs_;                            //kCoDel: 逗留时间目标; kPredictive: 默认deadline
+    long long intervalUs_;                          //kCoDel: 逗留时间需持续超过target的时长
+    long long firstAboveUs_;                        //逗留时间开始持续超过target后, 再过interval的时刻, 0表示未超过
+    bool overloaded_;                               //kCoDel: 是否正在拒绝新任务
+    long long ewmaRunNs_;                           //kPredictive: 任务执行时间(ns)的指数加权平均, 0表示尚无样本
+    size_t codelShed_;                              //被kCoDel拒绝的任务数
+    size_t deadlineShed_;                           //被kPredictive拒绝的任务数
     pthread_mutex_t lock_;                          //mutex
     pthread_cond_t notify_;                         //condition
 };
@@ -0,0 +1,282 @@
+/*
+* Copyright (c) 2018, Leonardo Cheng <chengxiang085@gmail.com>.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+*  1. Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*
+*  2. Redistributions in binary form must reproduce the above copyright
+*     notice, this list of conditions and the following disclaimer in the
+*     documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/**
+* @file arena.h
+* @brief Per-worker scratch arena
+*/
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <stdexcept>
+#include <string.h>
+
+//工作线程私有的临时内存: 按指针递增分配, 小块释放后进入按16字节分级的空闲链表复用
+//每个任务执行完后回退到任务开始时的位置, 任务内也可以用mark/rewind设置检查点
+//已申请的内存块在回退后保留复用, 只在析构时归还给全局堆; 非线程安全, 只能在所属线程中使用
+class CArena
+{
+public:
+    //检查点, rewind后检查点之后分配的内存全部失效
+    struct CMark
+    {
+        size_t chunk;
+        size_t offset;
+    };
+
+    static const size_t kAlign = 16;                //空闲链表块的对齐与分级粒度
+    static const size_t kMaxClass = 1024;           //超过此大小的释放不进入空闲链表
+public:
+    explicit CArena(size_t chunkSize = 64 * 1024);
+    ~CArena();
+
+    void *allocate(size_t n, size_t align = alignof(std::max_align_t));
+    void deallocate(void *p, size_t n);
+
+    CMark mark() const
+    {
+        CMark m;
+        m.chunk = chunk_;
+        m.offset = offset_;
+        return m;
+    }
+    void rewind(const CMark& m);
+    void reset()
+    {
+        CMark m = {0, 0};
+        rewind(m);
+    }
+
+    //已向全局堆申请的总字节数
+    size_t capacity() const
+    {
+        size_t n = 0;
+        for(size_t i = 0; i < chunks_.size(); ++i){
+            n += chunks_[i].size;
+        }
+        return n;
+    }
+
+    //当前线程的arena, 由线程池的工作线程设置, 其它线程为NULL
+    static CArena*& current()
+    {
+        static thread_local CArena *arena = NULL;
+        return arena;
+    }
+private:
+    struct CChunk
+    {
+        char *data;
+        size_t size;
+    };
+
+    //空闲链表中的块, 复用块本身的内存存放next
+    struct CFreeBlock
+    {
+        CFreeBlock *next;
+    };
+
+    void *bump(size_t n, size_t align);
+private:
+    CArena(const CArena& a) = delete;
+    CArena& operator=(const CArena& a) = delete;
+private:
+    size_t chunkSize_;
+    std::vector<CChunk> chunks_;
+    size_t chunk_;                                  //当前分配所在的块
+    size_t offset_;                                 //当前块中已分配的字节数
+    CFreeBlock *freeList_[kMaxClass / kAlign + 1];
+    bool hasFree_;                                  //空闲链表非空, rewind时才需要清空
+};
+
+inline CArena::CArena(size_t chunkSize)
+:chunkSize_(chunkSize < kMaxClass ? kMaxClass : chunkSize),chunk_(0),offset_(0),hasFree_(false)
+{
+    memset(freeList_, 0, sizeof(freeList_));
+}
+
+inline CArena::~CArena()
+{
+    for(size_t i = 0; i < chunks_.size(); ++i){
+        ::operator delete(chunks_[i].data);
+    }
+}
+
+//在当前块中按指针递增分配, 不够时换到下一块, 没有下一块时向全局堆申请一块更大的
+inline void *CArena::bump(size_t n, size_t align)
+{
+    while(true){
+        if(chunk_ < chunks_.size()){
+            CChunk& c = chunks_[chunk_];
+            size_t begin = (reinterpret_cast<size_t>(c.data) + offset_ + align - 1) & ~(align - 1);
+            size_t end = begin + n;
+            if(end <= reinterpret_cast<size_t>(c.data) + c.size){
+                offset_ = end - reinterpret_cast<size_t>(c.data);
+                return reinterpret_cast<void*>(begin);
+            }
+            if(chunk_ + 1 < chunks_.size()){
+                ++chunk_;
+                offset_ = 0;
+                continue;
+            }
+        }
+
+        size_t size = chunks_.empty() ? chunkSize_ : chunks_.back().size * 2;
+        while(size < n + align){
+            size *= 2;
+        }
+        CChunk c;
+        c.data = static_cast<char*>(::operator new(size));
+        c.size = size;
+        chunks_.push_back(c);
+        chunk_ = chunks_.size() - 1;
+        offset_ = 0;
+    }
+}
+
+inline void *CArena::allocate(size_t n, size_t align)
+{
+    if(n == 0){
+        n = 1;
+    }
+    if(n <= kMaxClass){
+        //小块一律按分级大小分配, 释放后进入空闲链表时才不会被当作更大的块复用
+        size_t cls = (n + kAlign - 1) / kAlign;
+        if(align > kAlign){
+            return bump(cls * kAlign, align);
+        }
+        if(freeList_[cls] != NULL){
+            CFreeBlock *block = freeList_[cls];
+            freeList_[cls] = block->next;
+            return block;
+        }
+        return bump(cls * kAlign, kAlign);
+    }
+    return bump(n, align);
+}
+
+inline void CArena::deallocate(void *p, size_t n)
+{
+    if(p == NULL || n > kMaxClass){
+        return;
+    }
+    size_t cls = ((n == 0 ? 1 : n) + kAlign - 1) / kAlign;
+    CFreeBlock *block = static_cast<CFreeBlock*>(p);
+    block->next = freeList_[cls];
+    freeList_[cls] = block;
+    hasFree_ = true;
+}
+
+inline void CArena::rewind(const CMark& m)
+{
+    chunk_ = m.chunk;
+    offset_ = m.offset;
+    //空闲链表中可能有检查点之后分配的块, 全部丢弃
+    if(hasFree_){
+        memset(freeList_, 0, sizeof(freeList_));
+        hasFree_ = false;
+    }
+}
+
+//基于CArena的STL分配器, 默认使用当前工作线程的arena
+//容器不能比任务活得久, 也不能交给其它线程释放
+template<class T>
+class CArenaAllocator
+{
+public:
+    typedef T value_type;
+
+    template<class U>
+    struct rebind
+    {
+        typedef CArenaAllocator<U> other;
+    };
+public:
+    CArenaAllocator();
+    explicit CArenaAllocator(CArena& arena):
+    arena_(&arena)
+    {}
+
+    template<class U>
+    CArenaAllocator(const CArenaAllocator<U>& other):
+    arena_(other.arena())
+    {}
+
+    T *allocate(size_t n)
+    {
+        return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        arena_->deallocate(p, n * sizeof(T));
+    }
+
+    CArena *arena() const
+    {
+        return arena_;
+    }
+private:
+    CArena *arena_;
+};
+
+template<class T, class U>
+bool operator==(const CArenaAllocator<T>& lhs, const CArenaAllocator<U>& rhs)
+{
+    return lhs.arena() == rhs.arena();
+}
+
+template<class T, class U>
+bool operator!=(const CArenaAllocator<T>& lhs, const CArenaAllocator<U>& rhs)
+{
+    return lhs.arena() != rhs.arena();
+}
+
+namespace this_worker
+{
+    //当前工作线程的arena, 不在线程池的工作线程中调用时抛出std::logic_error
+    inline CArena& arena()
+    {
+        CArena *a = CArena::current();
+        if(a == NULL){
+            throw std::logic_error("this_worker::arena() called outside a threadpool worker!");
+        }
+        return *a;
+    }
+}
+
+template<class T>
+CArenaAllocator<T>::CArenaAllocator():
+arena_(&this_worker::arena())
+{}
+
+#endif
@@ -0,0 +1,80 @@
+#include "fileio.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <chrono>
+using namespace std;
+
+// 对比在普通CThreadpool任务中pread与通过CFileIo(io_uring)读同一文件的耗时
+// 用法: ./bench_fileio [文件路径] [文件大小MB] [块大小KB]
+int main(int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : "bench_fileio.dat";
+    const size_t fileSize = (argc > 2 ? atol(argv[2]) : 256) << 20;
+    const size_t blockSize = (argc > 3 ? atol(argv[3]) : 64) << 10;
+    const size_t nblock = fileSize / blockSize;
+    const int kThreads = 4;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0){
+        perror("open");
+        return 1;
+    }
+    vector<char> buf(fileSize, 'x');
+    if(pwrite(fd, buf.data(), fileSize, 0) != (ssize_t)fileSize){
+        perror("pwrite");
+        return 1;
+    }
+
+    try{
+        CThreadpool pool(kThreads);
+
+        auto start = chrono::steady_clock::now();
+        vector<future<ssize_t>> v;
+        for(size_t i = 0; i < nblock; ++i){
+            char *p = &buf[i * blockSize];
+            off_t off = i * blockSize;
+            v.push_back(pool.add([=]{return pread(fd, p, blockSize, off);}));
+        }
+        for(size_t i = 0; i < v.size(); ++i){
+            v[i].get();
+        }
+        auto pooled = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+
+        CFileIo io(pool, 256, 32);
+        start = chrono::steady_clock::now();
+        v.clear();
+        for(size_t i = 0; i < nblock; ++i){
+            v.push_back(io.async_read(fd, &buf[i * blockSize], blockSize, i * blockSize));
+        }
+        io.submit();
+        for(size_t i = 0; i < v.size(); ++i){
+            v[i].get();
+        }
+        auto uring = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+
+        vector<iovec> iov(1);
+        iov[0].iov_base = buf.data();
+        iov[0].iov_len = fileSize;
+        io.registerBuffers(iov);
+        start = chrono::steady_clock::now();
+        v.clear();
+        for(size_t i = 0; i < nblock; ++i){
+            v.push_back(io.async_read_fixed(fd, &buf[i * blockSize], blockSize, i * blockSize, 0));
+        }
+        io.submit();
+        for(size_t i = 0; i < v.size(); ++i){
+            v[i].get();
+        }
+        auto fixed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+
+        cout << nblock << " reads of " << (blockSize >> 10) << "KB, io_uring " << (io.usingIoUring() ? "on" : "off") << endl;
+        cout << "CThreadpool pread: " << pooled << " us" << endl;
+        cout << "CFileIo async_read: " << uring << " us" << endl;
+        cout << "CFileIo async_read_fixed: " << fixed << " us" << endl;
+    }catch(exception& ex){
+        cout << ex.what() << endl;
+    }
+    close(fd);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,78 @@
+#include "threadpool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <algorithm>
+using namespace std;
+
+// 递归fib与快速排序: 任务中add子任务再等待其结果
+// 用法: ./bench_forkjoin [--blocking]
+// 默认用CThreadpool::wait, 工作线程等待时会执行其它任务; --blocking改用future::get,
+// 所有工作线程都阻塞在get上后线程池死锁, 程序会卡住
+static bool blocking = false;
+
+template<class T>
+static T join(CThreadpool& pool, future<T>& f)
+{
+    return blocking ? f.get() : pool.wait(f);
+}
+
+static long fibSerial(int n)
+{
+    return n < 2 ? n : fibSerial(n - 1) + fibSerial(n - 2);
+}
+
+static long fib(CThreadpool& pool, int n)
+{
+    if(n < 20){
+        return fibSerial(n);
+    }
+    auto left = pool.add(fib, ref(pool), n - 1);
+    long right = fib(pool, n - 2);
+    return join(pool, left) + right;
+}
+
+static void quicksort(CThreadpool& pool, int *first, int *last)
+{
+    if(last - first < 10000){
+        sort(first, last);
+        return;
+    }
+    int pivot = first[(last - first) / 2];
+    int *mid1 = partition(first, last, [pivot](int x){return x < pivot;});
+    int *mid2 = partition(mid1, last, [pivot](int x){return !(pivot < x);});
+    auto left = pool.add(quicksort, ref(pool), first, mid1);
+    quicksort(pool, mid2, last);
+    join(pool, left);
+}
+
+int main(int argc, char **argv)
+{
+    blocking = (argc > 1 && strcmp(argv[1], "--blocking") == 0);
+    const int kFib = 36;
+    const size_t kSortSize = 10000000;
+    int maxThread = max(4u, thread::hardware_concurrency());
+
+    vector<int> data(kSortSize);
+    for(int nthread = 1; nthread <= maxThread; nthread *= 2){
+        CThreadpool pool(nthread);
+
+        auto start = chrono::steady_clock::now();
+        auto f = pool.add(fib, ref(pool), kFib);
+        long result = f.get();
+        auto fibMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+
+        srand(1);
+        for(size_t i = 0; i < data.size(); ++i){
+            data[i] = rand();
+        }
+        start = chrono::steady_clock::now();
+        auto s = pool.add(quicksort, ref(pool), data.data(), data.data() + data.size());
+        s.get();
+        auto sortMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+
+        cout << nthread << " threads: fib(" << kFib << ") = " << result << " " << fibMs << " ms, quicksort "
+             << kSortSize << " ints " << sortMs << " ms" << (is_sorted(data.begin(), data.end()) ? "" : " (unsorted!)") << endl;
+    }
+    return 0;
+}
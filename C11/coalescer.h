@@ -0,0 +1,239 @@
+/*
+* Copyright (c) 2018, Leonardo Cheng <chengxiang085@gmail.com>.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+*  1. Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*
+*  2. Redistributions in binary form must reproduce the above copyright
+*     notice, this list of conditions and the following disclaimer in the
+*     documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/**
+* @file coalescer.h
+* @brief Coalesce small keyed submissions into batch tasks
+*/
+#ifndef _COALESCER_H_
+#define _COALESCER_H_
+
+#include "threadpool.h"
+#include <chrono>
+#include <unordered_map>
+
+//按key攒批: add_coalesced只把item追加到缓冲区, 某个key攒够maxBatch个或最早的item等待超过maxDelay时,
+//整批作为一个任务提交到线程池, 由handler处理一段连续的数组
+//缓冲区按提交线程分片, 不同线程的提交互不竞争; 同一key可能同时存在于多个分片中
+template<class Key, class Item, class Hash = std::hash<Key>>
+class CCoalescer
+{
+public:
+    typedef std::function<void(const Key&, Item*, size_t)> batch_handler;
+    typedef std::chrono::steady_clock clock_type;
+public:
+    //shards为0时取硬件线程数
+    CCoalescer(CThreadpool& pool, batch_handler handler, size_t maxBatch = 64,
+               std::chrono::microseconds maxDelay = std::chrono::microseconds(1000), size_t shards = 0);
+    ~CCoalescer();
+
+    void add_coalesced(const Key& key, Item item);
+    //立即提交所有缓冲区中的item
+    void flush();
+private:
+    struct CBuffer
+    {
+        std::vector<Item> items;
+        clock_type::time_point deadline;
+    };
+
+    //分片, 填充到独占缓存行避免伪共享
+    struct CShard
+    {
+        std::mutex lock;
+        std::unordered_map<Key, CBuffer, Hash> buffers;
+        char pad[64];
+    };
+
+    void dispatch(const Key& key, CBuffer& buffer);
+    void timerLoop();
+private:
+    CCoalescer(const CCoalescer& c) = delete;
+    CCoalescer& operator=(const CCoalescer& c) = delete;
+private:
+    CThreadpool& pool_;
+    std::shared_ptr<batch_handler> handler_;
+    size_t maxBatch_;
+    clock_type::duration maxDelay_;
+    std::vector<std::unique_ptr<CShard>> shards_;
+
+    bool stop_;                                     //由timerLock_保护
+    std::atomic<bool> armed_;                       //计时线程扫描后是否有新的缓冲区变为非空
+    std::mutex timerLock_;
+    std::condition_variable timerNotify_;
+    std::thread timer_;
+};
+
+template<class Key, class Item, class Hash>
+CCoalescer<Key, Item, Hash>::CCoalescer(CThreadpool& pool, batch_handler handler, size_t maxBatch,
+                                        std::chrono::microseconds maxDelay, size_t shards)
+:pool_(pool),handler_(std::make_shared<batch_handler>(std::move(handler))),
+maxBatch_(maxBatch == 0 ? 1 : maxBatch),maxDelay_(maxDelay),stop_(false),armed_(false)
+{
+    size_t nshard = shards;
+    if(nshard == 0){
+        nshard = std::thread::hardware_concurrency();
+        nshard = (nshard == 0 ? 2 : nshard);
+    }
+    for(size_t i = 0; i < nshard; ++i){
+        shards_.push_back(std::unique_ptr<CShard>(new CShard));
+    }
+    timer_ = std::thread([this]{timerLoop();});
+}
+
+template<class Key, class Item, class Hash>
+CCoalescer<Key, Item, Hash>::~CCoalescer()
+{
+    {
+        std::lock_guard<std::mutex> lg(timerLock_);
+        stop_ = true;
+    }
+    timerNotify_.notify_one();
+    timer_.join();
+
+    //被准入控制拒绝时稍后重试, 只有线程池已停止才丢弃剩余的item
+    for(;;){
+        try{
+            flush();
+            break;
+        }catch(const CTaskRejected&){
+            std::this_thread::sleep_for(maxDelay_);
+        }catch(const std::runtime_error&){
+            break;
+        }
+    }
+}
+
+//把缓冲区中的item作为一个任务提交, 调用时须持有所在分片的锁
+//线程池拒绝或已停止时item留在缓冲区中, 异常抛给调用者
+template<class Key, class Item, class Hash>
+void CCoalescer<Key, Item, Hash>::dispatch(const Key& key, CBuffer& buffer)
+{
+    auto batch = std::make_shared<std::vector<Item>>();
+    batch->reserve(maxBatch_);
+    //任务入队后可能立即执行, 必须在add之前取走item; 持有分片锁, 失败时原样换回
+    batch->swap(buffer.items);
+
+    std::shared_ptr<batch_handler> handler = handler_;
+    try{
+        pool_.add([handler, key, batch]{(*handler)(key, batch->data(), batch->size());});
+    }catch(...){
+        buffer.items.swap(*batch);
+        throw;
+    }
+}
+
+template<class Key, class Item, class Hash>
+void CCoalescer<Key, Item, Hash>::add_coalesced(const Key& key, Item item)
+{
+    CShard& shard = *shards_[std::hash<std::thread::id>()(std::this_thread::get_id()) % shards_.size()];
+    bool first = false;
+    {
+        std::lock_guard<std::mutex> lg(shard.lock);
+        CBuffer& buffer = shard.buffers[key];
+        if(buffer.items.empty()){
+            if(buffer.items.capacity() == 0){
+                buffer.items.reserve(maxBatch_);
+            }
+            buffer.deadline = clock_type::now() + maxDelay_;
+            first = true;
+        }
+        buffer.items.push_back(std::move(item));
+        if(buffer.items.size() >= maxBatch_){
+            try{
+                dispatch(key, buffer);
+            }catch(...){
+                //本次的item视为未接受, 之前的item留给计时线程稍后重试
+                buffer.items.pop_back();
+                throw;
+            }
+            return;
+        }
+    }
+
+    //缓冲区由空变为非空时, 确保计时线程知道有新的截止时间
+    if(first && !armed_.exchange(true)){
+        std::lock_guard<std::mutex> lg(timerLock_);
+        timerNotify_.notify_one();
+    }
+}
+
+template<class Key, class Item, class Hash>
+void CCoalescer<Key, Item, Hash>::flush()
+{
+    for(size_t i = 0; i < shards_.size(); ++i){
+        std::lock_guard<std::mutex> lg(shards_[i]->lock);
+        for(auto iter = shards_[i]->buffers.begin(); iter != shards_[i]->buffers.end(); ++iter){
+            if(!iter->second.items.empty()){
+                dispatch(iter->first, iter->second);
+            }
+        }
+    }
+}
+
+//计时线程: 提交超过maxDelay的缓冲区, 然后睡到最近的截止时间; 提交失败的缓冲区过maxDelay后重试
+template<class Key, class Item, class Hash>
+void CCoalescer<Key, Item, Hash>::timerLoop()
+{
+    std::unique_lock<std::mutex> ulk(timerLock_);
+    while(!stop_){
+        armed_.store(false);
+        ulk.unlock();
+
+        clock_type::time_point next = clock_type::time_point::max();
+        clock_type::time_point now = clock_type::now();
+        for(size_t i = 0; i < shards_.size(); ++i){
+            std::lock_guard<std::mutex> lg(shards_[i]->lock);
+            for(auto iter = shards_[i]->buffers.begin(); iter != shards_[i]->buffers.end(); ++iter){
+                CBuffer& buffer = iter->second;
+                if(buffer.items.empty()){
+                    continue;
+                }
+                if(buffer.deadline <= now){
+                    try{
+                        dispatch(iter->first, buffer);
+                    }catch(const std::runtime_error&){
+                        next = std::min(next, now + maxDelay_);
+                    }
+                }else if(buffer.deadline < next){
+                    next = buffer.deadline;
+                }
+            }
+        }
+
+        ulk.lock();
+        if(next == clock_type::time_point::max()){
+            timerNotify_.wait(ulk, [this]{return stop_ || armed_.load();});
+        }else{
+            timerNotify_.wait_until(ulk, next, [this]{return stop_;});
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,228 @@
+/*
+* Copyright (c) 2018, Leonardo Cheng <chengxiang085@gmail.com>.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+*  1. Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*
+*  2. Redistributions in binary form must reproduce the above copyright
+*     notice, this list of conditions and the following disclaimer in the
+*     documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/**
+* @file completion.h
+* @brief Completion queue: results of pool tasks in finish order
+*/
+#ifndef _COMPLETION_H_
+#define _COMPLETION_H_
+
+#include "threadpool.h"
+#include <algorithm>
+
+//通过它提交的任务完成后, 已就绪的future按完成顺序进入队列, 调用者用next/try_next/drain取走, 无需逐个轮询future
+//完成的任务压入无锁MPSC链表, 只有链表由空变为非空的那次压入才唤醒消费者, 消费者一次取走整批
+//add可在任意线程调用, next/try_next/drain只能在同一个线程中调用; 须先于线程池析构, 析构时等待所有已提交的任务完成
+template<class T>
+class CCompletionQueue
+{
+public:
+    explicit CCompletionQueue(CThreadpool& pool);
+    ~CCompletionQueue();
+
+    template<class Function, class... Types>
+    void add(Function&&, Types&&...);
+
+    //阻塞到有任务完成, 返回其已就绪的future, 任务抛出的异常由get()重新抛出; 没有未取走的任务时抛出std::logic_error
+    std::future<T> next();
+    bool try_next(std::future<T>& result);
+    //把已完成的结果全部追加到out, 返回个数; wait为true且暂无结果时阻塞到至少有一个
+    size_t drain(std::vector<std::future<T>>& out, bool wait = false);
+
+    //已提交但尚未取走的任务数
+    size_t pending() const
+    {
+        return pending_.load(std::memory_order_relaxed);
+    }
+private:
+    struct CNode
+    {
+        CNode *next;
+        std::future<T> result;
+    };
+
+    void push(CNode *node);
+    bool grab(bool wait);
+private:
+    CCompletionQueue(const CCompletionQueue& cq) = delete;
+    CCompletionQueue& operator=(const CCompletionQueue& cq) = delete;
+private:
+    CThreadpool& pool_;
+    std::atomic<CNode*> head_;                      //已完成但未被消费者取走的结点, 后完成的在前
+    std::vector<CNode*> batch_;                     //消费者已取走的一批, 先完成的在后
+    std::atomic<size_t> pending_;                   //add在任意线程中增加, 消费者取走时减少
+    std::atomic<size_t> running_;                   //尚未压入结果的任务数
+    std::mutex lock_;
+    std::condition_variable notify_;
+};
+
+template<class T>
+CCompletionQueue<T>::CCompletionQueue(CThreadpool& pool)
+:pool_(pool),head_(NULL),pending_(0),running_(0)
+{}
+
+template<class T>
+CCompletionQueue<T>::~CCompletionQueue()
+{
+    //任务压入结果后最后一步才减running_, 之后不再访问this
+    while(running_.load(std::memory_order_acquire) > 0){
+        std::this_thread::yield();
+    }
+    grab(false);
+    for(size_t i = 0; i < batch_.size(); ++i){
+        delete batch_[i];
+    }
+}
+
+template<class T>
+template<class Function, class... Types>
+void CCompletionQueue<T>::add(Function&& fcn, Types&&... args)
+{
+    typedef std::packaged_task<T()> task;
+
+    auto t = std::make_shared<task>(std::bind(std::forward<Function>(fcn), std::forward<Types>(args)...));
+    CNode *node = new CNode;
+    node->next = NULL;
+    node->result = t->get_future();
+
+    //先计入pending_, 任务可能在add返回前就已完成, 此时消费者的next不能因pending_为0而抛出
+    running_.fetch_add(1, std::memory_order_relaxed);
+    pending_.fetch_add(1, std::memory_order_relaxed);
+    //任务因线程池停止被丢弃时, 销毁packaged_task使future得到broken_promise, 照常压入结果, 否则next和析构会一直等待
+    auto finally = std::make_shared<CTaskFinally>([this, t, node](bool ran){
+        if(!ran){
+            *t = task();
+            push(node);
+        }
+    });
+    try{
+        pool_.add([this, t, node, finally]{
+            finally->ran();
+            (*t)();
+            push(node);
+        });
+    }catch(...){
+        finally->dismiss();
+        pending_.fetch_sub(1, std::memory_order_relaxed);
+        running_.fetch_sub(1, std::memory_order_relaxed);
+        delete node;
+        throw;
+    }
+}
+
+template<class T>
+void CCompletionQueue<T>::push(CNode *node)
+{
+    CNode *old = head_.load(std::memory_order_relaxed);
+    do{
+        node->next = old;
+    }while(!head_.compare_exchange_weak(old, node, std::memory_order_release, std::memory_order_relaxed));
+
+    //只有链表由空变为非空时才需要唤醒, 之后的压入都属于同一批
+    if(old == NULL){
+        std::lock_guard<std::mutex> lg(lock_);
+        notify_.notify_one();
+    }
+    running_.fetch_sub(1, std::memory_order_release);
+}
+
+//取走整条链表放入batch_, batch_非空时直接返回true
+template<class T>
+bool CCompletionQueue<T>::grab(bool wait)
+{
+    if(!batch_.empty()){
+        return true;
+    }
+
+    CNode *list = head_.exchange(NULL, std::memory_order_acquire);
+    if(list == NULL && wait){
+        std::unique_lock<std::mutex> ulk(lock_);
+        notify_.wait(ulk, [this]{return head_.load(std::memory_order_relaxed) != NULL;});
+        list = head_.exchange(NULL, std::memory_order_acquire);
+    }
+    for(; list != NULL; list = list->next){
+        batch_.push_back(list);
+    }
+    return !batch_.empty();
+}
+
+template<class T>
+std::future<T> CCompletionQueue<T>::next()
+{
+    if(pending_.load(std::memory_order_relaxed) == 0){
+        throw std::logic_error("no pending task in completion queue!");
+    }
+    grab(true);
+    CNode *node = batch_.back();
+    batch_.pop_back();
+    std::future<T> result = std::move(node->result);
+    delete node;
+    pending_.fetch_sub(1, std::memory_order_relaxed);
+    return result;
+}
+
+template<class T>
+bool CCompletionQueue<T>::try_next(std::future<T>& result)
+{
+    if(!grab(false)){
+        return false;
+    }
+    CNode *node = batch_.back();
+    batch_.pop_back();
+    result = std::move(node->result);
+    delete node;
+    pending_.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+template<class T>
+size_t CCompletionQueue<T>::drain(std::vector<std::future<T>>& out, bool wait)
+{
+    if(!grab(wait && pending_.load(std::memory_order_relaxed) > 0)){
+        return 0;
+    }
+    //batch_之后又完成的也一并取走
+    std::vector<CNode*> older;
+    older.swap(batch_);
+    grab(false);
+    batch_.insert(batch_.end(), older.begin(), older.end());
+
+    size_t n = batch_.size();
+    while(!batch_.empty()){
+        CNode *node = batch_.back();
+        batch_.pop_back();
+        out.push_back(std::move(node->result));
+        delete node;
+    }
+    pending_.fetch_sub(n, std::memory_order_relaxed);
+    return n;
+}
+
+#endif
@@ -0,0 +1,432 @@
+/*
+* Copyright (c) 2018, Leonardo Cheng <chengxiang085@gmail.com>.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+*  1. Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*
+*  2. Redistributions in binary form must reproduce the above copyright
+*     notice, this list of conditions and the following disclaimer in the
+*     documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+* @file fileio.h
+* @brief Asynchronous file I/O backed by io_uring
+*/
+#ifndef _FILEIO_H_
+#define _FILEIO_H_
+
+#include "threadpool.h"
+#include <algorithm>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+//异步文件I/O, 提交到自己持有的io_uring, 完成后兑现future或把回调作为任务提交到线程池
+//读写使用单个iovec的READV/WRITEV而不是5.6才有的READ/WRITE, 5.1起的内核都支持
+//内核不支持io_uring时退化为在一组专用的阻塞I/O线程中执行pread/pwrite
+//结果为读写的字节数, 出错时为-errno; 调用者须保证buf在完成前有效, pool比CFileIo活得久
+class CFileIo
+{
+public:
+    typedef std::function<void(ssize_t)> io_callback;
+public:
+    //entries为提交队列长度; 攒够batch个请求才提交一次, 大于1时剩余的请求需调用submit()提交
+    explicit CFileIo(CThreadpool& pool, unsigned entries = 256, unsigned batch = 1, int fallbackThreads = 4);
+    ~CFileIo();
+
+    bool usingIoUring() const
+    {
+        return ringFd_.get() >= 0;
+    }
+
+    std::future<ssize_t> async_read(int fd, void *buf, size_t len, off_t off);
+    std::future<ssize_t> async_write(int fd, const void *buf, size_t len, off_t off);
+    std::future<ssize_t> async_fsync(int fd);
+    void async_read(int fd, void *buf, size_t len, off_t off, io_callback cb);
+    void async_write(int fd, const void *buf, size_t len, off_t off, io_callback cb);
+
+    //注册固定缓冲区, 之后*_fixed接口的buf必须落在第index个缓冲区内, 内核免去每次映射用户页
+    void registerBuffers(const std::vector<iovec>& bufs);
+    std::future<ssize_t> async_read_fixed(int fd, void *buf, size_t len, off_t off, unsigned index);
+    std::future<ssize_t> async_write_fixed(int fd, const void *buf, size_t len, off_t off, unsigned index);
+
+    //提交所有尚未提交的请求
+    void submit();
+private:
+    //一次异步请求, 地址作为user_data, 完成后由reapLoop释放
+    struct CIoRequest
+    {
+        std::promise<ssize_t> promise;
+        io_callback callback;
+        iovec iov;                                  //READV/WRITEV的单个iovec, 须在完成前有效
+    };
+
+    std::future<ssize_t> prepare(uint8_t opcode, int fd, const void *buf, size_t len, off_t off, int bufIndex);
+    void prepare(uint8_t opcode, int fd, const void *buf, size_t len, off_t off, int bufIndex, CIoRequest *req);
+    void prepare(uint8_t opcode, int fd, const void *buf, size_t len, off_t off, io_callback cb);
+    static ssize_t blockingIo(uint8_t opcode, int fd, const void *buf, size_t len, off_t off);
+    void submitLocked();
+    void complete(CIoRequest *req, ssize_t res);
+    void reapLoop();
+    void setupRing(unsigned entries);
+    void teardownRing();
+private:
+    CFileIo(const CFileIo& fi) = delete;
+    CFileIo& operator=(const CFileIo& fi) = delete;
+private:
+    CThreadpool& pool_;
+    unsigned batch_;
+    CFdGuard ringFd_;
+
+    //提交队列, 由sqLock_保护
+    std::mutex sqLock_;
+    void *sqRing_;
+    size_t sqRingSize_;
+    unsigned *sqHead_;
+    unsigned *sqTail_;
+    unsigned sqMask_;
+    unsigned sqEntries_;
+    unsigned *sqArray_;
+    io_uring_sqe *sqes_;
+    unsigned pending_;                              //已写入提交队列但未提交的请求数
+
+    //完成队列, 只由reapLoop访问
+    void *cqRing_;
+    size_t cqRingSize_;
+    unsigned *cqHead_;
+    unsigned *cqTail_;
+    unsigned cqMask_;
+    io_uring_cqe *cqes_;
+    unsigned cqEntries_;
+
+    std::atomic<size_t> inflight_;                  //已提交但未完成的请求数, 不超过cqEntries_
+    std::mutex reapLock_;                           //与reapNotify_一起等待inflight_低于上限
+    std::condition_variable reapNotify_;
+    std::thread reaper_;
+    std::unique_ptr<CThreadpool> blockingPool_;     //不支持io_uring时执行阻塞I/O的线程组
+};
+
+inline CFileIo::CFileIo(CThreadpool& pool, unsigned entries, unsigned batch, int fallbackThreads)
+:pool_(pool),batch_(batch == 0 ? 1 : batch),
+sqRing_(MAP_FAILED),sqRingSize_(0),sqEntries_(0),sqes_(NULL),pending_(0),
+cqRing_(MAP_FAILED),cqRingSize_(0),cqEntries_(0),inflight_(0)
+{
+    setupRing(entries);
+    if(usingIoUring()){
+        reaper_ = std::thread([this]{reapLoop();});
+    }else{
+        blockingPool_.reset(new CThreadpool(fallbackThreads, "blockio"));
+    }
+}
+
+inline CFileIo::~CFileIo()
+{
+    if(usingIoUring()){
+        //用user_data为0的NOP通知reapLoop退出, 它会等到所有请求完成
+        std::lock_guard<std::mutex> lg(sqLock_);
+        prepare(IORING_OP_NOP, -1, NULL, 0, 0, -1, NULL);
+        submitLocked();
+    }
+    if(reaper_.joinable()){
+        reaper_.join();
+    }
+    teardownRing();
+}
+
+//创建io_uring并映射提交、完成队列, 失败时ringFd_保持为-1
+inline void CFileIo::setupRing(unsigned entries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(fd < 0){
+        return;
+    }
+    ringFd_.reset(fd);
+    sqEntries_ = params.sq_entries;
+    cqEntries_ = params.cq_entries;
+
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+    }
+
+    sqRing_ = mmap(NULL, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(sqRing_ == MAP_FAILED){
+        teardownRing();
+        return;
+    }
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        cqRing_ = sqRing_;
+    }else{
+        cqRing_ = mmap(NULL, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(cqRing_ == MAP_FAILED){
+            teardownRing();
+            return;
+        }
+    }
+    void *sqes = mmap(NULL, sqEntries_ * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED){
+        teardownRing();
+        return;
+    }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    char *sq = static_cast<char*>(sqRing_);
+    sqHead_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+    char *cq = static_cast<char*>(cqRing_);
+    cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+inline void CFileIo::teardownRing()
+{
+    if(cqRing_ != MAP_FAILED && cqRing_ != sqRing_){
+        munmap(cqRing_, cqRingSize_);
+    }
+    if(sqRing_ != MAP_FAILED){
+        munmap(sqRing_, sqRingSize_);
+        if(sqes_ != NULL){
+            munmap(sqes_, sqEntries_ * sizeof(io_uring_sqe));
+        }
+    }
+    sqRing_ = cqRing_ = MAP_FAILED;
+    sqes_ = NULL;
+    ringFd_.reset(-1);
+}
+
+//把请求写入提交队列, 调用时须持有sqLock_
+//未完成的请求达到完成队列长度时先等待收割, 否则没有IORING_FEAT_NODROP的内核会丢弃完成事件
+inline void CFileIo::prepare(uint8_t opcode, int fd, const void *buf, size_t len, off_t off, int bufIndex, CIoRequest *req)
+{
+    if(inflight_.load(std::memory_order_acquire) >= cqEntries_){
+        submitLocked();
+        std::unique_lock<std::mutex> ul(reapLock_);
+        reapNotify_.wait(ul, [this]{return inflight_.load(std::memory_order_acquire) < cqEntries_;});
+    }
+
+    unsigned tail = *sqTail_;
+    //队列已满时先提交, 未开启SQPOLL时内核在io_uring_enter中同步取走所有请求
+    if(tail - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) == sqEntries_){
+        submitLocked();
+    }
+
+    unsigned index = tail & sqMask_;
+    io_uring_sqe *sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = len;
+    sqe->off = off;
+    if(opcode == IORING_OP_READV || opcode == IORING_OP_WRITEV){
+        req->iov.iov_base = const_cast<void*>(buf);
+        req->iov.iov_len = len;
+        sqe->addr = reinterpret_cast<uint64_t>(&req->iov);
+        sqe->len = 1;
+    }
+    if(bufIndex >= 0){
+        sqe->buf_index = bufIndex;
+    }
+    sqe->user_data = reinterpret_cast<uint64_t>(req);
+    sqArray_[index] = index;
+    __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+
+    inflight_.fetch_add(1, std::memory_order_relaxed);
+    if(++pending_ >= batch_){
+        submitLocked();
+    }
+}
+
+inline std::future<ssize_t> CFileIo::prepare(uint8_t opcode, int fd, const void *buf, size_t len, off_t off, int bufIndex)
+{
+    if(!usingIoUring()){
+        return blockingPool_->add(&CFileIo::blockingIo, opcode, fd, buf, len, off);
+    }
+
+    CIoRequest *req = new CIoRequest;
+    std::future<ssize_t> ret = req->promise.get_future();
+    std::lock_guard<std::mutex> lg(sqLock_);
+    prepare(opcode, fd, buf, len, off, bufIndex, req);
+    return ret;
+}
+
+inline void CFileIo::prepare(uint8_t opcode, int fd, const void *buf, size_t len, off_t off, io_callback cb)
+{
+    if(!usingIoUring()){
+        //阻塞I/O完成后再把回调交给线程池, 避免回调占用阻塞I/O线程
+        CThreadpool &pool = pool_;
+        blockingPool_->add([=, &pool]{pool.add_continuation(cb, blockingIo(opcode, fd, buf, len, off));});
+        return;
+    }
+
+    CIoRequest *req = new CIoRequest;
+    req->callback = std::move(cb);
+    std::lock_guard<std::mutex> lg(sqLock_);
+    prepare(opcode, fd, buf, len, off, -1, req);
+}
+
+//不支持io_uring时在阻塞I/O线程组中执行的同步版本
+inline ssize_t CFileIo::blockingIo(uint8_t opcode, int fd, const void *buf, size_t len, off_t off)
+{
+    ssize_t n;
+    switch(opcode){
+    case IORING_OP_READV:
+    case IORING_OP_READ_FIXED:
+        n = pread(fd, const_cast<void*>(buf), len, off);
+        break;
+    case IORING_OP_WRITEV:
+    case IORING_OP_WRITE_FIXED:
+        n = pwrite(fd, buf, len, off);
+        break;
+    case IORING_OP_FSYNC:
+        n = fsync(fd);
+        break;
+    default:
+        errno = EINVAL;
+        n = -1;
+    }
+    return n < 0 ? -errno : n;
+}
+
+inline void CFileIo::submitLocked()
+{
+    while(pending_ > 0){
+        int n = syscall(__NR_io_uring_enter, ringFd_.get(), pending_, 0, 0, NULL, 0);
+        if(n < 0){
+            if(errno == EINTR || errno == EAGAIN || errno == EBUSY){
+                continue;
+            }
+            throw std::system_error(errno, std::system_category(), "io_uring_enter");
+        }
+        pending_ -= n;
+    }
+}
+
+inline void CFileIo::submit()
+{
+    if(usingIoUring()){
+        std::lock_guard<std::mutex> lg(sqLock_);
+        submitLocked();
+    }
+}
+
+inline void CFileIo::complete(CIoRequest *req, ssize_t res)
+{
+    if(req->callback){
+        try{
+            pool_.add_continuation(std::move(req->callback), res);
+        }catch(const std::runtime_error&){
+            //线程池已停止, 丢弃回调
+        }
+    }else{
+        req->promise.set_value(res);
+    }
+    delete req;
+}
+
+//收割完成队列, 直到收到析构发出的NOP且所有请求都已完成
+inline void CFileIo::reapLoop()
+{
+    bool stopping = false;
+    while(!stopping || inflight_.load(std::memory_order_acquire) > 0){
+        int n = syscall(__NR_io_uring_enter, ringFd_.get(), 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(n < 0 && errno != EINTR){
+            std::cerr << "io_uring_enter error! " << strerror(errno) << std::endl;
+            return;
+        }
+
+        unsigned head = *cqHead_;
+        unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+        for(; head != tail; ++head){
+            const io_uring_cqe &cqe = cqes_[head & cqMask_];
+            CIoRequest *req = reinterpret_cast<CIoRequest*>(cqe.user_data);
+            if(req == NULL){
+                stopping = true;
+            }else{
+                complete(req, cqe.res);
+            }
+            inflight_.fetch_sub(1, std::memory_order_release);
+        }
+        __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+        {
+            std::lock_guard<std::mutex> lg(reapLock_);
+        }
+        reapNotify_.notify_all();
+    }
+}
+
+inline std::future<ssize_t> CFileIo::async_read(int fd, void *buf, size_t len, off_t off)
+{
+    return prepare(IORING_OP_READV, fd, buf, len, off, -1);
+}
+
+inline std::future<ssize_t> CFileIo::async_write(int fd, const void *buf, size_t len, off_t off)
+{
+    return prepare(IORING_OP_WRITEV, fd, buf, len, off, -1);
+}
+
+inline std::future<ssize_t> CFileIo::async_fsync(int fd)
+{
+    return prepare(IORING_OP_FSYNC, fd, NULL, 0, 0, -1);
+}
+
+inline void CFileIo::async_read(int fd, void *buf, size_t len, off_t off, io_callback cb)
+{
+    prepare(IORING_OP_READV, fd, buf, len, off, std::move(cb));
+}
+
+inline void CFileIo::async_write(int fd, const void *buf, size_t len, off_t off, io_callback cb)
+{
+    prepare(IORING_OP_WRITEV, fd, buf, len, off, std::move(cb));
+}
+
+inline void CFileIo::registerBuffers(const std::vector<iovec>& bufs)
+{
+    if(!usingIoUring()){
+        return;
+    }
+    if(syscall(__NR_io_uring_register, ringFd_.get(), IORING_REGISTER_BUFFERS, bufs.data(), bufs.size()) < 0){
+        throw std::system_error(errno, std::system_category(), "io_uring_register");
+    }
+}
+
+inline std::future<ssize_t> CFileIo::async_read_fixed(int fd, void *buf, size_t len, off_t off, unsigned index)
+{
+    return prepare(IORING_OP_READ_FIXED, fd, buf, len, off, index);
+}
+
+inline std::future<ssize_t> CFileIo::async_write_fixed(int fd, const void *buf, size_t len, off_t off, unsigned index)
+{
+    return prepare(IORING_OP_WRITE_FIXED, fd, buf, len, off, index);
+}
+
+#endif
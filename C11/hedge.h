@@ -0,0 +1,379 @@
+/*
+* Copyright (c) 2018, Leonardo Cheng <chengxiang085@gmail.com>.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+*  1. Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*
+*  2. Redistributions in binary form must reproduce the above copyright
+*     notice, this list of conditions and the following disclaimer in the
+*     documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/**
+* @file hedge.h
+* @brief Hedged execution of idempotent tasks
+*/
+#ifndef _HEDGE_H_
+#define _HEDGE_H_
+
+#include "threadpool.h"
+#include <algorithm>
+
+//对冲执行的任务通过它得知另一份执行已经先完成, 可以提前返回(返回值会被丢弃)
+class CHedgeToken
+{
+public:
+    explicit CHedgeToken(const std::atomic<bool>& done):
+    done_(done)
+    {}
+
+    bool cancelled() const
+    {
+        return done_.load(std::memory_order_relaxed);
+    }
+private:
+    const std::atomic<bool>& done_;
+};
+
+//对冲执行: 任务开始执行后若在hedgeAfter内还没完成, 就向线程池再提交一份, 由另一个工作线程执行,
+//先完成的结果(包括异常)兑现future, 另一份通过CHedgeToken协作取消; 只适用于幂等任务
+//hedgeAfter为负时取最近执行时间的percentile分位数; 对冲次数不超过总任务数的budget比例
+//须先于线程池析构, 析构时等待所有已提交的执行结束
+class CHedger
+{
+public:
+    struct CStats
+    {
+        size_t tasks;                               //add_hedged提交的任务数
+        size_t hedged;                              //启动了对冲的任务数, hedged / tasks 即对冲率
+        size_t hedgeWins;                           //对冲的那一份先完成的次数
+    };
+public:
+    CHedger(CThreadpool& pool, double budget = 0.05, double percentile = 0.95);
+    ~CHedger();
+
+    //fn以const CHedgeToken&为参数
+    template<class Function>
+    std::future<typename std::result_of<Function(const CHedgeToken&)>::type>
+    add_hedged(Function&& fcn, std::chrono::microseconds hedgeAfter = std::chrono::microseconds(-1));
+
+    CStats stats() const
+    {
+        CStats s;
+        s.tasks = tasks_.load(std::memory_order_relaxed);
+        s.hedged = hedged_.load(std::memory_order_relaxed);
+        s.hedgeWins = hedgeWins_.load(std::memory_order_relaxed);
+        return s;
+    }
+private:
+    typedef std::chrono::steady_clock clock_type;
+
+    //同一任务的两份执行共享的状态
+    template<class R>
+    struct CState
+    {
+        std::function<R(const CHedgeToken&)> fn;
+        std::promise<R> promise;
+        std::atomic<bool> done;
+        std::chrono::microseconds hedgeAfter;
+    };
+
+    //到期后检查是否需要对冲
+    struct CTimer
+    {
+        clock_type::time_point deadline;
+        std::function<void()> fire;
+
+        bool operator<(const CTimer& other) const
+        {
+            return deadline > other.deadline;
+        }
+    };
+
+    template<class R>
+    void spawn(const std::shared_ptr<CState<R>>& state, bool hedge);
+    template<class R>
+    void attempt(const std::shared_ptr<CState<R>>& state, bool hedge);
+    template<class R>
+    static bool complete(CState<R>& state, const CHedgeToken& token, std::false_type);
+    template<class R>
+    static bool complete(CState<R>& state, const CHedgeToken& token, std::true_type);
+
+    void arm(clock_type::duration delay, std::function<void()> fire);
+    bool tryHedge();
+    clock_type::duration hedgeDelay();
+    void record(clock_type::duration runTime);
+    void timerLoop();
+private:
+    CHedger(const CHedger& h) = delete;
+    CHedger& operator=(const CHedger& h) = delete;
+private:
+    static const size_t kSamples = 256;             //计算分位数用的最近执行时间个数
+    static const size_t kMinSamples = 16;           //样本不足时不做自适应对冲
+
+    CThreadpool& pool_;
+    double budget_;
+    double percentile_;
+
+    std::atomic<size_t> tasks_;
+    std::atomic<size_t> hedged_;
+    std::atomic<size_t> hedgeWins_;
+    std::atomic<size_t> running_;                   //已提交但尚未结束的执行数
+
+    std::mutex sampleLock_;                         //保护以下三项
+    std::vector<int64_t> samples_;                  //最近的执行时间(ns), 环形覆盖
+    size_t sampleCount_;
+    int64_t threshold_;                             //缓存的分位数, 每kSamples/8个新样本重新计算
+
+    bool stop_;                                     //以下由timerLock_保护
+    std::mutex timerLock_;
+    std::condition_variable timerNotify_;
+    std::vector<CTimer> timers_;                    //按deadline的小顶堆
+    std::thread timer_;
+};
+
+inline CHedger::CHedger(CThreadpool& pool, double budget, double percentile)
+:pool_(pool),budget_(budget),percentile_(std::min(std::max(percentile, 0.0), 1.0)),
+tasks_(0),hedged_(0),hedgeWins_(0),running_(0),sampleCount_(0),threshold_(-1),stop_(false)
+{
+    samples_.reserve(kSamples);
+    timer_ = std::thread([this]{timerLoop();});
+}
+
+inline CHedger::~CHedger()
+{
+    //先停掉定时线程, 之后不会再有新的对冲提交; 正在执行的fire在join前已把对冲计入running_
+    {
+        std::lock_guard<std::mutex> lg(timerLock_);
+        stop_ = true;
+        timers_.clear();
+    }
+    timerNotify_.notify_one();
+    timer_.join();
+
+    while(running_.load(std::memory_order_acquire) > 0){
+        std::this_thread::yield();
+    }
+}
+
+template<class Function>
+std::future<typename std::result_of<Function(const CHedgeToken&)>::type>
+CHedger::add_hedged(Function&& fcn, std::chrono::microseconds hedgeAfter)
+{
+    typedef typename std::result_of<Function(const CHedgeToken&)>::type return_type;
+
+    auto state = std::make_shared<CState<return_type>>();
+    state->fn = std::forward<Function>(fcn);
+    state->done.store(false, std::memory_order_relaxed);
+    state->hedgeAfter = hedgeAfter;
+    auto ret = state->promise.get_future();
+
+    tasks_.fetch_add(1, std::memory_order_relaxed);
+    try{
+        spawn(state, false);
+    }catch(...){
+        tasks_.fetch_sub(1, std::memory_order_relaxed);
+        throw;
+    }
+    return ret;
+}
+
+//向线程池提交一份执行并计入running_, 提交失败时撤销并重新抛出;
+//因线程池停止被丢弃时归还running_, 被丢弃的是第一份(此时还没有对冲)则以broken_promise兑现future
+template<class R>
+void CHedger::spawn(const std::shared_ptr<CState<R>>& state, bool hedge)
+{
+    running_.fetch_add(1, std::memory_order_relaxed);
+    auto finally = std::make_shared<CTaskFinally>([this, state, hedge](bool ran){
+        if(ran){
+            return;
+        }
+        if(!hedge && !state->done.exchange(true, std::memory_order_acq_rel)){
+            //放弃原来的共享状态, future得到broken_promise
+            state->promise = std::promise<R>();
+        }
+        running_.fetch_sub(1, std::memory_order_release);
+    });
+    try{
+        pool_.add([this, state, hedge, finally]{
+            finally->ran();
+            attempt(state, hedge);
+        });
+    }catch(...){
+        finally->dismiss();
+        running_.fetch_sub(1, std::memory_order_relaxed);
+        throw;
+    }
+}
+
+//执行一份; 第一份开始执行时设置对冲定时器, 先完成者兑现promise
+template<class R>
+void CHedger::attempt(const std::shared_ptr<CState<R>>& state, bool hedge)
+{
+    if(!state->done.load(std::memory_order_acquire)){
+        if(!hedge){
+            clock_type::duration delay = state->hedgeAfter.count() < 0 ? hedgeDelay() : state->hedgeAfter;
+            if(delay >= clock_type::duration::zero()){
+                std::weak_ptr<CState<R>> weak = state;
+                arm(delay, [this, weak]{
+                    std::shared_ptr<CState<R>> s = weak.lock();
+                    if(s && !s->done.load(std::memory_order_acquire) && tryHedge()){
+                        try{
+                            spawn(s, true);
+                        }catch(const std::runtime_error&){
+                            //过载(CTaskRejected)或已停止时放弃对冲, 第一份仍会兑现future
+                            hedged_.fetch_sub(1, std::memory_order_relaxed);
+                        }
+                    }
+                });
+            }
+        }
+
+        CHedgeToken token(state->done);
+        clock_type::time_point start = clock_type::now();
+        //只记录胜出者的执行时间, 被取消的那份提前返回会拉低分位数
+        if(complete(*state, token, std::is_void<R>())){
+            record(clock_type::now() - start);
+            if(hedge){
+                hedgeWins_.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+    running_.fetch_sub(1, std::memory_order_release);
+}
+
+template<class R>
+bool CHedger::complete(CState<R>& state, const CHedgeToken& token, std::false_type)
+{
+    try{
+        R r = state.fn(token);
+        if(!state.done.exchange(true, std::memory_order_acq_rel)){
+            state.promise.set_value(std::move(r));
+            return true;
+        }
+    }catch(...){
+        if(!state.done.exchange(true, std::memory_order_acq_rel)){
+            state.promise.set_exception(std::current_exception());
+            return true;
+        }
+    }
+    return false;
+}
+
+template<class R>
+bool CHedger::complete(CState<R>& state, const CHedgeToken& token, std::true_type)
+{
+    try{
+        state.fn(token);
+        if(!state.done.exchange(true, std::memory_order_acq_rel)){
+            state.promise.set_value();
+            return true;
+        }
+    }catch(...){
+        if(!state.done.exchange(true, std::memory_order_acq_rel)){
+            state.promise.set_exception(std::current_exception());
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void CHedger::arm(clock_type::duration delay, std::function<void()> fire)
+{
+    CTimer t;
+    clock_type::time_point deadline = clock_type::now() + delay;
+    t.deadline = deadline;
+    t.fire = std::move(fire);
+    bool earliest;
+    {
+        std::lock_guard<std::mutex> lg(timerLock_);
+        timers_.push_back(std::move(t));
+        std::push_heap(timers_.begin(), timers_.end());
+        earliest = timers_.front().deadline == deadline;
+    }
+    //只有新定时器成为最早到期者时才需要唤醒定时线程
+    if(earliest){
+        timerNotify_.notify_one();
+    }
+}
+
+//预算: 对冲数不超过 budget * 任务数
+inline bool CHedger::tryHedge()
+{
+    size_t tasks = tasks_.load(std::memory_order_relaxed);
+    size_t hedged = hedged_.load(std::memory_order_relaxed);
+    while(static_cast<double>(hedged + 1) <= budget_ * static_cast<double>(tasks)){
+        if(hedged_.compare_exchange_weak(hedged, hedged + 1, std::memory_order_relaxed)){
+            return true;
+        }
+    }
+    return false;
+}
+
+//自适应对冲延迟, 样本不足时返回负值表示不对冲
+inline CHedger::clock_type::duration CHedger::hedgeDelay()
+{
+    std::lock_guard<std::mutex> lg(sampleLock_);
+    return std::chrono::nanoseconds(threshold_);
+}
+
+inline void CHedger::record(clock_type::duration runTime)
+{
+    int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(runTime).count();
+    std::lock_guard<std::mutex> lg(sampleLock_);
+    if(samples_.size() < kSamples){
+        samples_.push_back(ns);
+    }else{
+        samples_[sampleCount_ % kSamples] = ns;
+    }
+    ++sampleCount_;
+    if(sampleCount_ >= kMinSamples && (threshold_ < 0 || sampleCount_ % (kSamples / 8) == 0)){
+        std::vector<int64_t> sorted(samples_);
+        size_t k = static_cast<size_t>(percentile_ * (sorted.size() - 1));
+        std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+        threshold_ = sorted[k];
+    }
+}
+
+inline void CHedger::timerLoop()
+{
+    std::unique_lock<std::mutex> ul(timerLock_);
+    while(!stop_){
+        if(timers_.empty()){
+            timerNotify_.wait(ul);
+            continue;
+        }
+        //拷贝一份, 等待期间timers_可能扩容
+        clock_type::time_point deadline = timers_.front().deadline;
+        if(clock_type::now() < deadline){
+            timerNotify_.wait_until(ul, deadline);
+            continue;
+        }
+        std::pop_heap(timers_.begin(), timers_.end());
+        CTimer t = std::move(timers_.back());
+        timers_.pop_back();
+        ul.unlock();
+        t.fire();
+        ul.lock();
+    }
+}
+
+#endif
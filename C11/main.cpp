@@ -1,4 +1,5 @@
 #include "threadpool.h"
+#include "completion.h"
 using namespace std;
 
 int main(int argc, char **argv)
@@ -6,12 +7,11 @@ int main(int argc, char **argv)
     mutex mtx;
     try{
         CThreadpool pool;
-        vector<future<int>> v1;
+        CCompletionQueue<int> cq(pool);
         vector<future<void>> v2;
         
         for(int i = 0; i < 10; ++i){
-            auto ans = pool.add([](int answer){return answer;}, i);
-            v1.push_back(std::move(ans));
+            cq.add([](int answer){return answer;}, i);
         }
         for(int i = 0; i < 5; ++i){
             auto ans = pool.add([&mtx](const string& str1, const string& str2){
@@ -22,9 +22,11 @@ int main(int argc, char **argv)
             v2.push_back(std::move(ans));
         }
 
-        for(size_t i = 0; i < v1.size(); ++i){
+        //按完成顺序取结果, 先完成的不用等前面提交的慢任务
+        while(cq.pending() > 0){
+            int answer = cq.next().get();
             lock_guard<mutex> lg(mtx);
-            cout << v1[i].get() << endl;
+            cout << answer << endl;
         }
         for(size_t i = 0; i < v2.size(); ++i){
             v2[i].get();
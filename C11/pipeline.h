@@ -0,0 +1,268 @@
+/*
+* Copyright (c) 2018, Leonardo Cheng <chengxiang085@gmail.com>.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+*  1. Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*
+*  2. Redistributions in binary form must reproduce the above copyright
+*     notice, this list of conditions and the following disclaimer in the
+*     documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/**
+* @file pipeline.h
+* @brief Multi-stage pipeline on top of CThreadpool
+*/
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include "threadpool.h"
+#include <exception>
+
+//多级流水线: 每个item由一个任务依次带过各级(数据留在同一个工作线程的缓存中), 并行级直接执行,
+//串行级按push的顺序逐个执行, 提前到达的item放入该级的有界无锁重排序槽位, 由当前执行该级的线程接着处理
+//同时在途的item最多tokens个, push在令牌用完时阻塞, 因此内存和排队都是有界的
+template<class T>
+class CPipeline
+{
+public:
+    enum StageMode
+    {
+        kParallel,      //多个item可同时执行, 不保证顺序
+        kSerialInOrder  //同一时刻只执行一个item, 且按push的顺序执行
+    };
+
+    typedef std::function<void(T&)> stage_fn;
+public:
+    CPipeline(CThreadpool& pool, size_t tokens = 64);
+    ~CPipeline();
+
+    //须在第一次push之前添加
+    CPipeline& addStage(StageMode mode, stage_fn fn);
+
+    //在途item达到tokens个时阻塞
+    void push(T item);
+    //等待所有item流过全部各级, 有级抛出过异常时重新抛出第一个; 不能在本线程池的工作线程中调用
+    void finish();
+private:
+    struct CItem
+    {
+        uint64_t seq;
+        bool failed;                                //某一级抛出过异常, 之后只参与串行级排序不再执行
+        T value;
+    };
+
+    struct CStage
+    {
+        StageMode mode;
+        stage_fn fn;
+        std::unique_ptr<std::atomic<CItem*>[]> slots;  //kSerialInOrder: 按seq % tokens存放等待执行的item
+        std::atomic<bool> busy;                     //kSerialInOrder: 是否有线程正在执行该级
+        uint64_t next;                              //kSerialInOrder: 下一个应执行的seq, 只由busy的持有者访问
+    };
+
+    void runItem(CItem *item, size_t stage);
+    CItem *enterSerial(CItem *item, size_t stage);
+    void runStage(CStage& st, CItem *item);
+    void spawn(CItem *item, size_t stage);
+    void release(CItem *item);
+private:
+    CPipeline(const CPipeline& p) = delete;
+    CPipeline& operator=(const CPipeline& p) = delete;
+private:
+    CThreadpool& pool_;
+    size_t tokens_;
+    std::vector<std::unique_ptr<CStage>> stages_;
+    uint64_t nextSeq_;                              //由lock_保护
+
+    std::mutex lock_;
+    std::condition_variable notify_;
+    size_t inflight_;                               //由lock_保护
+    std::exception_ptr error_;                      //由lock_保护
+};
+
+template<class T>
+CPipeline<T>::CPipeline(CThreadpool& pool, size_t tokens)
+:pool_(pool),tokens_(tokens == 0 ? 1 : tokens),nextSeq_(0),inflight_(0)
+{}
+
+template<class T>
+CPipeline<T>::~CPipeline()
+{
+    std::unique_lock<std::mutex> ulk(lock_);
+    notify_.wait(ulk, [this]{return inflight_ == 0;});
+}
+
+template<class T>
+CPipeline<T>& CPipeline<T>::addStage(StageMode mode, stage_fn fn)
+{
+    std::unique_ptr<CStage> st(new CStage);
+    st->mode = mode;
+    st->fn = std::move(fn);
+    st->busy.store(false);
+    st->next = 0;
+    if(mode == kSerialInOrder){
+        st->slots.reset(new std::atomic<CItem*>[tokens_]);
+        for(size_t i = 0; i < tokens_; ++i){
+            st->slots[i].store(NULL, std::memory_order_relaxed);
+        }
+    }
+    stages_.push_back(std::move(st));
+    return *this;
+}
+
+template<class T>
+void CPipeline<T>::push(T item)
+{
+    CItem *it = new CItem;
+    it->failed = false;
+    it->value = std::move(item);
+    {
+        std::unique_lock<std::mutex> ulk(lock_);
+        notify_.wait(ulk, [this]{return inflight_ < tokens_;});
+        ++inflight_;
+        it->seq = nextSeq_++;
+    }
+    spawn(it, 0);
+}
+
+template<class T>
+void CPipeline<T>::finish()
+{
+    std::unique_lock<std::mutex> ulk(lock_);
+    notify_.wait(ulk, [this]{return inflight_ == 0;});
+    if(error_){
+        std::exception_ptr error = error_;
+        error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+//提交一个任务把item从第stage级带到最后, 不经过准入控制(item在push时已被接受);
+//线程池已停止时在当前线程执行, 保证item不会丢失而使令牌无法归还;
+//已入队的任务因线程池停止被丢弃时, item记为失败后照常经过余下各级(串行级只排序不执行)并归还令牌
+template<class T>
+void CPipeline<T>::spawn(CItem *item, size_t stage)
+{
+    auto finally = std::make_shared<CTaskFinally>([this, item, stage](bool ran){
+        if(ran){
+            return;
+        }
+        item->failed = true;
+        {
+            std::lock_guard<std::mutex> lg(lock_);
+            if(!error_){
+                error_ = std::make_exception_ptr(std::runtime_error("threadpool has stopped!"));
+            }
+        }
+        runItem(item, stage);
+    });
+    try{
+        pool_.add_continuation([this, finally, item, stage]{
+            finally->ran();
+            runItem(item, stage);
+        });
+    }catch(const std::runtime_error&){
+        finally->dismiss();
+        runItem(item, stage);
+    }
+}
+
+template<class T>
+void CPipeline<T>::runStage(CStage& st, CItem *item)
+{
+    if(item->failed){
+        return;
+    }
+    try{
+        st.fn(item->value);
+    }catch(...){
+        item->failed = true;
+        std::lock_guard<std::mutex> lg(lock_);
+        if(!error_){
+            error_ = std::current_exception();
+        }
+    }
+}
+
+template<class T>
+void CPipeline<T>::runItem(CItem *item, size_t stage)
+{
+    for(size_t i = stage; i < stages_.size(); ++i){
+        if(stages_[i]->mode == kParallel){
+            runStage(*stages_[i], item);
+            continue;
+        }
+        item = enterSerial(item, i);
+        if(item == NULL){
+            return;
+        }
+    }
+    release(item);
+}
+
+//把item放入串行级的槽位, 若没有线程在执行该级就按顺序执行所有已到达的item
+//返回当前线程接着带往下一级的item, 其余执行完的item各自提交任务; 返回NULL表示item留给别的线程
+//在途item不超过tokens个, 所以同一时刻seq % tokens不会冲突
+template<class T>
+typename CPipeline<T>::CItem *CPipeline<T>::enterSerial(CItem *item, size_t stage)
+{
+    CStage& st = *stages_[stage];
+    st.slots[item->seq % tokens_].store(item, std::memory_order_seq_cst);
+
+    CItem *carry = NULL;
+    while(!st.busy.exchange(true, std::memory_order_seq_cst)){
+        while(true){
+            std::atomic<CItem*>& slot = st.slots[st.next % tokens_];
+            CItem *ready = slot.load(std::memory_order_acquire);
+            if(ready == NULL){
+                break;
+            }
+            slot.store(NULL, std::memory_order_relaxed);
+            runStage(st, ready);
+            ++st.next;
+            if(carry != NULL){
+                spawn(carry, stage + 1);
+            }
+            carry = ready;
+        }
+        //放下busy之后next可能被其它线程修改, 先记下
+        uint64_t next = st.next;
+        st.busy.store(false, std::memory_order_seq_cst);
+        //放下busy之前又有item到达了下一个位置, 而到达的线程看到busy为true已离开
+        if(st.slots[next % tokens_].load(std::memory_order_seq_cst) == NULL){
+            break;
+        }
+    }
+    return carry;
+}
+
+template<class T>
+void CPipeline<T>::release(CItem *item)
+{
+    delete item;
+    //在锁内通知, 否则finish返回后CPipeline可能先于notify_all被析构
+    std::lock_guard<std::mutex> lg(lock_);
+    --inflight_;
+    notify_.notify_all();
+}
+
+#endif
@@ -0,0 +1,677 @@
+/*
+* Copyright (c) 2018, Leonardo Cheng <chengxiang085@gmail.com>.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are
+* met:
+*
+*  1. Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*
+*  2. Redistributions in binary form must reproduce the above copyright
+*     notice, this list of conditions and the following disclaimer in the
+*     documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+* HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/**
+* @file shmring.h
+* @brief Cross-process task submission through a shared-memory ring
+*/
+#ifndef _SHMRING_H_
+#define _SHMRING_H_
+
+#include "threadpool.h"
+#include <limits.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "shared-memory ring requires address-free lock-free atomics");
+
+//共享内存段布局: CShmSegment, 请求槽位数组, 完成槽位数组; 所有字段都是定长的, 两端进程直接映射使用
+//任务类型由双方约定的id标识, 请求和结果都内联在槽位中
+
+//环形队列头, 有界MPMC队列(Dmitry Vyukov), 跨进程可用
+struct CShmRingHeader
+{
+    alignas(64) std::atomic<uint64_t> enqueuePos;
+    alignas(64) std::atomic<uint64_t> dequeuePos;
+    alignas(64) std::atomic<uint32_t> wakeSeq;      //futex字, 入队或出队后有等待者时加1并唤醒
+    std::atomic<uint32_t> waiters;                  //正在等待非空或空槽位的线程数
+};
+
+struct CShmSegment
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotCount;                             //每个环形队列的槽位数, 2的幂
+    uint32_t slotSize;                              //每个槽位的字节数, 含CShmSlot头
+    CShmRingHeader request;                         //客户端 -> 线程池
+    CShmRingHeader completion;                      //线程池 -> 客户端
+};
+
+//槽位头, 之后紧跟payload
+struct CShmSlot
+{
+    std::atomic<uint64_t> seq;
+    uint64_t id;                                    //请求id, 结果中原样带回
+    uint32_t type;                                  //任务类型id
+    uint32_t length;                                //payload长度
+    int32_t status;                                 //结果状态, 未注册的类型为-ENOSYS
+    uint32_t reserved;
+
+    char *payload()
+    {
+        return reinterpret_cast<char*>(this + 1);
+    }
+};
+
+//进程内对一个环形队列的视图
+class CShmRing
+{
+public:
+    CShmRing():
+    header_(NULL),slots_(NULL),slotCount_(0),slotSize_(0)
+    {}
+
+    void attach(CShmRingHeader *header, char *slots, uint32_t slotCount, uint32_t slotSize)
+    {
+        header_ = header;
+        slots_ = slots;
+        slotCount_ = slotCount;
+        slotSize_ = slotSize;
+    }
+
+    //初始化槽位序号, 只由创建共享内存段的一方调用
+    void init()
+    {
+        for(uint32_t i = 0; i < slotCount_; ++i){
+            slot(i)->seq.store(i, std::memory_order_relaxed);
+        }
+        header_->enqueuePos.store(0, std::memory_order_relaxed);
+        header_->dequeuePos.store(0, std::memory_order_relaxed);
+        header_->wakeSeq.store(0, std::memory_order_relaxed);
+        header_->waiters.store(0, std::memory_order_release);
+    }
+
+    //占用一个空槽位, 写完后须调用commitPush; 队列满时返回NULL
+    CShmSlot *tryClaimPush(uint64_t& pos)
+    {
+        pos = header_->enqueuePos.load(std::memory_order_relaxed);
+        while(true){
+            CShmSlot *s = slot(pos);
+            int64_t diff = static_cast<int64_t>(s->seq.load(std::memory_order_acquire)) - static_cast<int64_t>(pos);
+            if(diff == 0){
+                if(header_->enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                    return s;
+                }
+            }else if(diff < 0){
+                return NULL;
+            }else{
+                pos = header_->enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void commitPush(CShmSlot *s, uint64_t pos)
+    {
+        s->seq.store(pos + 1, std::memory_order_release);
+        //与wait中的waiters加1配对, 保证要么看到等待者, 要么等待者看到新元素
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(header_->waiters.load(std::memory_order_relaxed) > 0){
+            header_->wakeSeq.fetch_add(1, std::memory_order_release);
+            futex(&header_->wakeSeq, FUTEX_WAKE, INT_MAX, NULL);
+        }
+    }
+
+    //取出一个已写好的槽位, 读完后须调用commitPop; 队列空时返回NULL
+    CShmSlot *tryClaimPop(uint64_t& pos)
+    {
+        pos = header_->dequeuePos.load(std::memory_order_relaxed);
+        while(true){
+            CShmSlot *s = slot(pos);
+            int64_t diff = static_cast<int64_t>(s->seq.load(std::memory_order_acquire)) - static_cast<int64_t>(pos + 1);
+            if(diff == 0){
+                if(header_->dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                    return s;
+                }
+            }else if(diff < 0){
+                return NULL;
+            }else{
+                pos = header_->dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void commitPop(CShmSlot *s, uint64_t pos)
+    {
+        s->seq.store(pos + slotCount_, std::memory_order_release);
+        //与waitNotFull配对, 唤醒等待空槽位的生产者
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(header_->waiters.load(std::memory_order_relaxed) > 0){
+            header_->wakeSeq.fetch_add(1, std::memory_order_release);
+            futex(&header_->wakeSeq, FUTEX_WAKE, INT_MAX, NULL);
+        }
+    }
+
+    //已入队(可能尚未写完)的元素个数
+    size_t size() const
+    {
+        uint64_t enq = header_->enqueuePos.load(std::memory_order_acquire);
+        uint64_t deq = header_->dequeuePos.load(std::memory_order_acquire);
+        return enq > deq ? enq - deq : 0;
+    }
+
+    //队列为空时在futex上等待, 最多timeoutMs毫秒
+    void wait(int timeoutMs)
+    {
+        header_->waiters.fetch_add(1, std::memory_order_seq_cst);
+        uint32_t seq = header_->wakeSeq.load(std::memory_order_acquire);
+        if(size() == 0){
+            timespec ts;
+            ts.tv_sec = timeoutMs / 1000;
+            ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+            futex(&header_->wakeSeq, FUTEX_WAIT, seq, &ts);
+        }
+        header_->waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    //队列中至少有reserved个空槽位之前在futex上等待, 最多timeoutMs毫秒; 与wait共用eventcount, 被对方唤醒时只是多检查一次
+    void waitNotFull(size_t reserved, int timeoutMs)
+    {
+        header_->waiters.fetch_add(1, std::memory_order_seq_cst);
+        uint32_t seq = header_->wakeSeq.load(std::memory_order_acquire);
+        if(size() + reserved >= slotCount_){
+            timespec ts;
+            ts.tv_sec = timeoutMs / 1000;
+            ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+            futex(&header_->wakeSeq, FUTEX_WAIT, seq, &ts);
+        }
+        header_->waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    //唤醒所有等待者, 用于停止
+    void wakeAll()
+    {
+        header_->wakeSeq.fetch_add(1, std::memory_order_release);
+        futex(&header_->wakeSeq, FUTEX_WAKE, INT_MAX, NULL);
+    }
+
+    uint32_t payloadCapacity() const
+    {
+        return slotSize_ - sizeof(CShmSlot);
+    }
+
+    uint32_t capacity() const
+    {
+        return slotCount_;
+    }
+private:
+    CShmSlot *slot(uint64_t pos) const
+    {
+        return reinterpret_cast<CShmSlot*>(slots_ + (pos & (slotCount_ - 1)) * slotSize_);
+    }
+
+    //跨进程共享, 不能使用FUTEX_PRIVATE_FLAG
+    static long futex(std::atomic<uint32_t> *addr, int op, uint32_t val, const timespec *ts)
+    {
+        return syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), op, val, ts, NULL, 0);
+    }
+private:
+    CShmRingHeader *header_;
+    char *slots_;
+    uint32_t slotCount_;
+    uint32_t slotSize_;
+};
+
+//映射共享内存段并建立两个环形队列的视图
+class CShmMapping
+{
+public:
+    static const uint32_t kMagic = 0x53484d52;      //"SHMR"
+    static const uint32_t kVersion = 1;
+public:
+    CShmMapping():
+    segment_(NULL),size_(0)
+    {}
+
+    ~CShmMapping()
+    {
+        if(segment_ != NULL){
+            munmap(segment_, size_);
+        }
+    }
+
+    static size_t segmentSize(uint32_t slotCount, uint32_t slotSize)
+    {
+        return sizeof(CShmSegment) + 2 * static_cast<size_t>(slotCount) * slotSize;
+    }
+
+    //create为true时设置大小并初始化段头, 否则校验段头
+    void map(int fd, bool create, uint32_t slotCount, uint32_t slotSize)
+    {
+        if(create){
+            if(slotCount == 0 || (slotCount & (slotCount - 1)) != 0){
+                throw std::invalid_argument("slotCount must be a power of 2!");
+            }
+            if(slotSize <= sizeof(CShmSlot) || slotSize % alignof(CShmSlot) != 0){
+                throw std::invalid_argument("slotSize too small or misaligned!");
+            }
+            size_ = segmentSize(slotCount, slotSize);
+            if(ftruncate(fd, size_) < 0){
+                throw std::system_error(errno, std::system_category(), "ftruncate");
+            }
+        }else{
+            struct stat st;
+            if(fstat(fd, &st) < 0){
+                throw std::system_error(errno, std::system_category(), "fstat");
+            }
+            size_ = st.st_size;
+            if(size_ < sizeof(CShmSegment)){
+                throw std::runtime_error("shared-memory segment too small!");
+            }
+        }
+
+        void *p = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(p == MAP_FAILED){
+            throw std::system_error(errno, std::system_category(), "mmap");
+        }
+        segment_ = static_cast<CShmSegment*>(p);
+
+        if(create){
+            //ftruncate后的内容全为0, 原子变量无需构造
+            segment_->slotCount = slotCount;
+            segment_->slotSize = slotSize;
+            segment_->version = kVersion;
+        }else if(segment_->magic != kMagic || segment_->version != kVersion
+                 || segmentSize(segment_->slotCount, segment_->slotSize) != size_){
+            throw std::runtime_error("not a threadpool shared-memory segment!");
+        }
+
+        char *slots = reinterpret_cast<char*>(segment_ + 1);
+        size_t ringBytes = static_cast<size_t>(segment_->slotCount) * segment_->slotSize;
+        request_.attach(&segment_->request, slots, segment_->slotCount, segment_->slotSize);
+        completion_.attach(&segment_->completion, slots + ringBytes, segment_->slotCount, segment_->slotSize);
+
+        if(create){
+            request_.init();
+            completion_.init();
+            //magic最后写入, 客户端看到magic时段已初始化完毕
+            __atomic_store_n(&segment_->magic, kMagic, __ATOMIC_RELEASE);
+        }
+    }
+
+    CShmRing& request()
+    {
+        return request_;
+    }
+
+    CShmRing& completion()
+    {
+        return completion_;
+    }
+private:
+    CShmMapping(const CShmMapping& m) = delete;
+    CShmMapping& operator=(const CShmMapping& m) = delete;
+private:
+    CShmSegment *segment_;
+    size_t size_;
+    CShmRing request_;
+    CShmRing completion_;
+};
+
+//线程池一侧: 创建共享内存段, 请求队列非空时向线程池提交drain任务, 由工作线程直接执行请求并写回结果
+//同一个段的结果不区分客户端, 多个客户端进程应各用一个段
+class CShmServer
+{
+public:
+    //in/inLen为请求payload; out可写outLen字节, 返回前把outLen改为实际写入的字节数; 返回值作为结果的status
+    typedef std::function<int(const char *in, size_t inLen, char *out, size_t& outLen)> handler_type;
+public:
+    //name以'/'开头时用shm_open创建(析构时unlink), 为空时用memfd_create创建, 通过fd()传给客户端进程
+    //maxDrainers为同时执行drain任务的工作线程数上限, 0表示线程池工作线程数的一半(至少1个)
+    CShmServer(CThreadpool& pool, const std::string& name, uint32_t slotCount = 1024,
+               uint32_t slotSize = 256, size_t maxDrainers = 0);
+    ~CShmServer();
+
+    //须在start之前注册
+    void registerHandler(uint32_t type, handler_type handler);
+    void start();
+
+    int fd() const
+    {
+        return fd_.get();
+    }
+private:
+    void waitLoop();
+    bool reserveCompletion();
+    void drain();
+    void process(CShmSlot *request, char *out);
+private:
+    CShmServer(const CShmServer& s) = delete;
+    CShmServer& operator=(const CShmServer& s) = delete;
+private:
+    static const size_t kDrainBatch = 256;          //每个drain任务最多处理的请求数, 避免长期占用工作线程
+
+    CThreadpool& pool_;
+    std::string name_;
+    CFdGuard fd_;
+    CShmMapping mapping_;
+    std::unordered_map<uint32_t, handler_type> handlers_;
+    size_t maxDrainers_;
+
+    std::atomic<bool> stop_;
+    std::mutex drainLock_;
+    std::condition_variable drainNotify_;
+    size_t activeDrainers_;                         //由drainLock_保护
+    std::atomic<size_t> reserved_;                  //drain任务已为取出的请求预留、尚未写入的完成队列槽位数
+    std::thread waiter_;
+};
+
+inline CShmServer::CShmServer(CThreadpool& pool, const std::string& name, uint32_t slotCount,
+                              uint32_t slotSize, size_t maxDrainers)
+:pool_(pool),name_(name),maxDrainers_(maxDrainers),stop_(false),activeDrainers_(0),reserved_(0)
+{
+    if(name_.empty()){
+        fd_.reset(memfd_create("threadpool-shmring", MFD_CLOEXEC));
+    }else{
+        fd_.reset(shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600));
+    }
+    if(fd_.get() < 0){
+        throw std::system_error(errno, std::system_category(), name_.empty() ? "memfd_create" : "shm_open");
+    }
+    try{
+        mapping_.map(fd_.get(), true, slotCount, slotSize);
+    }catch(...){
+        if(!name_.empty()){
+            shm_unlink(name_.c_str());
+        }
+        throw;
+    }
+
+    //留出工作线程给线程池中的其它任务
+    if(maxDrainers_ == 0){
+        maxDrainers_ = std::max<size_t>(pool_.size() / 2, 1);
+    }
+}
+
+inline CShmServer::~CShmServer()
+{
+    stop_.store(true, std::memory_order_release);
+    mapping_.request().wakeAll();
+    mapping_.completion().wakeAll();
+    if(waiter_.joinable()){
+        waiter_.join();
+    }
+    //drain任务引用了this, 等它们全部结束
+    {
+        std::unique_lock<std::mutex> ulk(drainLock_);
+        drainNotify_.wait(ulk, [this]{return activeDrainers_ == 0;});
+    }
+    if(!name_.empty()){
+        shm_unlink(name_.c_str());
+    }
+}
+
+inline void CShmServer::registerHandler(uint32_t type, handler_type handler)
+{
+    if(waiter_.joinable()){
+        throw std::logic_error("registerHandler must be called before start!");
+    }
+    handlers_[type] = std::move(handler);
+}
+
+inline void CShmServer::start()
+{
+    if(!waiter_.joinable()){
+        waiter_ = std::thread([this]{waitLoop();});
+    }
+}
+
+//等待请求队列非空, 按积压情况提交drain任务; 自身不执行请求
+//完成队列满时(客户端取结果慢或已退出)不提交drain任务, 在本线程中等待而不占用工作线程
+inline void CShmServer::waitLoop()
+{
+    CShmRing& ring = mapping_.request();
+    CShmRing& completion = mapping_.completion();
+    while(!stop_.load(std::memory_order_acquire)){
+        if(ring.size() == 0){
+            ring.wait(100);
+            continue;
+        }
+        //客户端取走结果时commitPop会唤醒这里; 超时只是兜底, 客户端已退出时每秒也只醒来10次
+        size_t reserved = reserved_.load(std::memory_order_acquire);
+        if(completion.size() + reserved >= completion.capacity()){
+            completion.waitNotFull(reserved, 100);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> ulk(drainLock_);
+        if(activeDrainers_ >= maxDrainers_ || activeDrainers_ >= ring.size()){
+            //已有足够的drain任务, 等其中一个结束后再看
+            drainNotify_.wait_for(ulk, std::chrono::milliseconds(1));
+            continue;
+        }
+        ++activeDrainers_;
+        ulk.unlock();
+        //drain任务执行完或因线程池停止被丢弃时都归还计数, 否则析构会一直等待
+        auto finally = std::make_shared<CTaskFinally>([this](bool){
+            std::lock_guard<std::mutex> lg(drainLock_);
+            --activeDrainers_;
+            drainNotify_.notify_all();
+        });
+        try{
+            pool_.add([this, finally]{
+                finally->ran();
+                drain();
+            });
+        }catch(const std::runtime_error&){
+            //线程池已停止或拒绝了任务, 稍后重试
+            finally->dismiss();
+            ulk.lock();
+            --activeDrainers_;
+            drainNotify_.wait_for(ulk, std::chrono::milliseconds(1));
+        }
+    }
+}
+
+//为一个结果预留完成队列槽位, 队列已满时返回false
+inline bool CShmServer::reserveCompletion()
+{
+    CShmRing& completion = mapping_.completion();
+    size_t reserved = reserved_.load(std::memory_order_relaxed);
+    do{
+        if(completion.size() + reserved >= completion.capacity()){
+            return false;
+        }
+    }while(!reserved_.compare_exchange_weak(reserved, reserved + 1, std::memory_order_acq_rel));
+    return true;
+}
+
+//先预留完成队列槽位再取请求, 取出的请求一定能写回结果; 完成队列满时结束, 由waitLoop稍后重新提交
+inline void CShmServer::drain()
+{
+    CShmRing& ring = mapping_.request();
+    //结果缓冲区每个drain任务分配一次, 任务结束时随arena回退
+    char *out = static_cast<char*>(this_worker::arena().allocate(mapping_.completion().payloadCapacity()));
+    for(size_t i = 0; i < kDrainBatch && !stop_.load(std::memory_order_acquire); ++i){
+        if(!reserveCompletion()){
+            break;
+        }
+        uint64_t pos;
+        CShmSlot *request = ring.tryClaimPop(pos);
+        if(request == NULL){
+            reserved_.fetch_sub(1, std::memory_order_release);
+            break;
+        }
+        process(request, out);
+        ring.commitPop(request, pos);
+    }
+}
+
+//直接读取请求槽位中的payload执行, 结果先写到out(可写completion的payloadCapacity字节), 再拷贝到完成队列
+inline void CShmServer::process(CShmSlot *request, char *out)
+{
+    CShmRing& completion = mapping_.completion();
+    size_t capacity = completion.payloadCapacity();
+    size_t outLen = capacity;
+    int status;
+
+    auto iter = handlers_.find(request->type);
+    if(iter == handlers_.end()){
+        status = -ENOSYS;
+        outLen = 0;
+    }else{
+        size_t inLen = std::min<size_t>(request->length, mapping_.request().payloadCapacity());
+        status = iter->second(request->payload(), inLen, out, outLen);
+        outLen = std::min(outLen, capacity);
+    }
+
+    //槽位已预留, 只可能碰上客户端刚取出、尚未commitPop的那个槽位, 很快就能占用
+    uint64_t pos;
+    CShmSlot *result;
+    while((result = completion.tryClaimPush(pos)) == NULL){
+        //客户端在取结果的中途退出时该槽位永远不会释放, 停止时放弃
+        if(stop_.load(std::memory_order_acquire)){
+            reserved_.fetch_sub(1, std::memory_order_release);
+            return;
+        }
+        std::this_thread::yield();
+    }
+    reserved_.fetch_sub(1, std::memory_order_release);
+    result->id = request->id;
+    result->type = request->type;
+    result->status = status;
+    result->length = outLen;
+    memcpy(result->payload(), out, outLen);
+    completion.commitPush(result, pos);
+}
+
+//客户端进程中取到的一个结果
+struct CShmResult
+{
+    uint64_t id;
+    uint32_t type;
+    int32_t status;
+    std::vector<char> data;
+};
+
+//客户端一侧: 映射线程池进程创建的共享内存段, 提交请求并取回结果
+class CShmClient
+{
+public:
+    //打开shm_open创建的段
+    explicit CShmClient(const std::string& name);
+    //使用从线程池进程收到的memfd, fd的所有权不转移
+    explicit CShmClient(int fd);
+
+    //提交请求并返回其id, 请求队列满时等待; payload超过槽位容量时抛出std::length_error
+    uint64_t submit(uint32_t type, const void *data, size_t len);
+    bool tryNext(CShmResult& result);
+    //等待下一个结果, 超时返回false
+    bool next(CShmResult& result, int timeoutMs = -1);
+
+    size_t payloadCapacity()
+    {
+        return mapping_.request().payloadCapacity();
+    }
+private:
+    CShmClient(const CShmClient& c) = delete;
+    CShmClient& operator=(const CShmClient& c) = delete;
+private:
+    CFdGuard fd_;
+    CShmMapping mapping_;
+    std::atomic<uint64_t> nextId_;
+};
+
+inline CShmClient::CShmClient(const std::string& name)
+:nextId_(1)
+{
+    fd_.reset(shm_open(name.c_str(), O_RDWR, 0));
+    if(fd_.get() < 0){
+        throw std::system_error(errno, std::system_category(), "shm_open");
+    }
+    mapping_.map(fd_.get(), false, 0, 0);
+}
+
+inline CShmClient::CShmClient(int fd)
+:nextId_(1)
+{
+    mapping_.map(fd, false, 0, 0);
+}
+
+inline uint64_t CShmClient::submit(uint32_t type, const void *data, size_t len)
+{
+    CShmRing& ring = mapping_.request();
+    if(len > ring.payloadCapacity()){
+        throw std::length_error("payload exceeds shared-memory slot capacity!");
+    }
+
+    uint64_t pos;
+    CShmSlot *request;
+    while((request = ring.tryClaimPush(pos)) == NULL){
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    uint64_t id = nextId_.fetch_add(1, std::memory_order_relaxed);
+    request->id = id;
+    request->type = type;
+    request->status = 0;
+    request->length = len;
+    memcpy(request->payload(), data, len);
+    ring.commitPush(request, pos);
+    return id;
+}
+
+inline bool CShmClient::tryNext(CShmResult& result)
+{
+    CShmRing& ring = mapping_.completion();
+    uint64_t pos;
+    CShmSlot *slot = ring.tryClaimPop(pos);
+    if(slot == NULL){
+        return false;
+    }
+    result.id = slot->id;
+    result.type = slot->type;
+    result.status = slot->status;
+    result.data.assign(slot->payload(), slot->payload() + std::min<size_t>(slot->length, ring.payloadCapacity()));
+    ring.commitPop(slot, pos);
+    return true;
+}
+
+inline bool CShmClient::next(CShmResult& result, int timeoutMs)
+{
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while(!tryNext(result)){
+        int waitMs = 100;
+        if(timeoutMs >= 0){
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            if(left <= 0){
+                return false;
+            }
+            waitMs = std::min<int>(waitMs, left);
+        }
+        mapping_.completion().wait(waitMs);
+    }
+    return true;
+}
+
+#endif
@@ -37,18 +37,33 @@
 #include <string>
 #include <functional>
 #include <vector>
-#include <queue>
+#include <deque>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <type_traits>
 #include <future>
+#include <atomic>
+#include <stdexcept>
+#include <system_error>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <unordered_map>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "arena.h"
 
 //维护工作线程,负责在析构时join工作线程
 class CThreadGuard
 {
 public:
-    CThreadGuard(std::vector<std::thread> &threadVec):
+    CThreadGuard(std::vector<pthread_t> &threadVec):
     threadVec_(threadVec)
     {}
 
@@ -56,9 +71,7 @@ public:
     {
         size_t size = threadVec_.size();
         for(size_t i = 0; i < size; ++i){
-            if(threadVec_[i].joinable()){
-                threadVec_[i].join();
-            }
+            pthread_join(threadVec_[i], NULL);
         }
     }
 private:
@@ -68,29 +81,215 @@ private:
     CThreadGuard(CThreadGuard&& tg) = delete;
     CThreadGuard& operator=(CThreadGuard&& tg) = delete;
 private:
-    std::vector<std::thread>& threadVec_;
+    std::vector<pthread_t>& threadVec_;
 };
 
-//线程池类
+//工作线程属性, 0表示使用系统默认值
+struct CThreadAttr
+{
+    CThreadAttr():stackSize(0), guardSize(0){}
+
+    size_t stackSize;                               //线程栈大小
+    size_t guardSize;                               //栈溢出保护区大小
+    std::string name;                               //线程名前缀, 实际名为"name-序号", 超过15字节截断
+};
+
+//持有一个文件描述符,负责在析构时close
+class CFdGuard
+{
+public:
+    explicit CFdGuard(int fd = -1):
+    fd_(fd)
+    {}
+
+    ~CFdGuard()
+    {
+        if(fd_ >= 0){
+            close(fd_);
+        }
+    }
+
+    int get() const
+    {
+        return fd_;
+    }
+
+    void reset(int fd)
+    {
+        if(fd_ >= 0){
+            close(fd_);
+        }
+        fd_ = fd;
+    }
+private:
+    CFdGuard(const CFdGuard& fg) = delete;
+    CFdGuard& operator=(const CFdGuard& fg) = delete;
+private:
+    int fd_;
+};
+
+//任务被准入控制拒绝时由add抛出
+class CTaskRejected : public std::runtime_error
+{
+public:
+    explicit CTaskRejected(const std::string& what):
+    std::runtime_error(what)
+    {}
+};
+
+//析构时调用fn, 参数为任务是否执行过; 提交给线程池的任务捕获它的shared_ptr, 开始执行时调用ran(),
+//这样任务执行完或因线程池停止被丢弃时都会调用fn, 用于归还计数、兑现结果; 提交失败时由提交者dismiss后自行清理
+class CTaskFinally
+{
+public:
+    explicit CTaskFinally(std::function<void(bool)> fn):
+    fn_(std::move(fn)),ran_(false)
+    {}
+
+    ~CTaskFinally()
+    {
+        if(fn_){
+            fn_(ran_);
+        }
+    }
+
+    void ran()
+    {
+        ran_ = true;
+    }
+
+    void dismiss()
+    {
+        fn_ = nullptr;
+    }
+private:
+    CTaskFinally(const CTaskFinally& tf) = delete;
+    CTaskFinally& operator=(const CTaskFinally& tf) = delete;
+private:
+    std::function<void(bool)> fn_;
+    bool ran_;
+};
+
+//线程池类, 工作线程在提交任务时按需创建, 最多maxThread_个
 class CThreadpool
 {
 public:
     typedef std::function<void()> task_type;
+    typedef std::function<void(uint32_t)> io_callback;   //参数为epoll返回的事件
+    typedef std::chrono::steady_clock clock_type;
+
+    //空闲工作线程的等待方式
+    enum WaitMode
+    {
+        kCondition,     //等待条件变量,只执行任务
+        kReactor        //等待共享的epoll,既执行任务也执行fd就绪回调,任务通过eventfd唤醒
+    };
+
+    //过载时的准入控制方式
+    enum AdmissionMode
+    {
+        kAdmitAll,      //不做准入控制
+        kCoDel,         //任务在队列中的逗留时间在整个interval内都超过target时拒绝新任务
+        kPredictive     //按 平均执行时间*队列长度/工作线程数 估计等待时间, 超过任务的deadline时拒绝
+    };
+
+    //被拒绝的任务数
+    struct CAdmissionStats
+    {
+        size_t codelShed;
+        size_t deadlineShed;
+    };
 public:
-    explicit CThreadpool(int num = 10);
+    explicit CThreadpool(int num = 10, const std::string& name = std::string(), WaitMode mode = kCondition);
+    //属性无效时抛出std::system_error
+    CThreadpool(int num, const CThreadAttr& attr, WaitMode mode = kCondition);
     ~CThreadpool()
     {
-        stop();        
-        notify_.notify_all();
+        stop();
     }
 
+    //停止后队列中尚未执行的任务被丢弃(其future得到broken_promise), 正在执行的任务不受影响
     void stop()
     {
         stop_.store(true, std::memory_order_release);
+        std::deque<CQueuedTask> dropped;
+        {
+            std::lock_guard<std::mutex> lg(lock_);
+            dropped.swap(taskQueue_);
+        }
+        notify_.notify_all();
+        wakeReactor();
+    }
+
+    //工作线程数上限
+    size_t size() const
+    {
+        return maxThread_;
     }
 
     template<class Function, class... Types>
     std::future<typename std::result_of<Function(Types...)>::type> add(Function&&, Types&&...);
+
+    //kPredictive模式下使用给定的deadline而不是setAdmission的target, 其它模式下与add相同
+    template<class Function, class... Types>
+    std::future<typename std::result_of<Function(Types...)>::type> add_within(std::chrono::microseconds, Function&&, Types&&...);
+
+    //提交已被接受的工作的后续任务(I/O完成回调、流水线的后续阶段等), 不经过准入控制,
+    //只在线程池已停止时抛出std::runtime_error; 对外部提交的新工作应使用add
+    template<class Function, class... Types>
+    std::future<typename std::result_of<Function(Types...)>::type> add_continuation(Function&&, Types&&...);
+
+    //等待f就绪并返回结果; 在本线程池的工作线程中调用时, 等待期间执行队列中的其它任务(优先最新提交的,
+    //通常就是刚刚add的子任务), 使任务中嵌套add再等待的分治算法不会因所有工作线程都阻塞而死锁
+    template<class T>
+    T wait(std::future<T>& f);
+
+    //kCoDel: target为逗留时间目标; kPredictive: target为add的默认deadline
+    //被拒绝时add立即抛出CTaskRejected
+    void setAdmission(AdmissionMode mode, std::chrono::microseconds target,
+                      std::chrono::microseconds interval = std::chrono::milliseconds(100));
+    CAdmissionStats admissionStats() const
+    {
+        CAdmissionStats stats;
+        stats.codelShed = codelShed_.load(std::memory_order_relaxed);
+        stats.deadlineShed = deadlineShed_.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    //仅kReactor模式可用: 注册fd, 就绪时由某个空闲工作线程直接调用cb
+    //同一fd的回调不会并发执行, cb不应抛出异常
+    void watch(int fd, uint32_t events, io_callback cb, bool edgeTriggered = false);
+    void unwatch(int fd);
+private:
+    //已注册fd的回调及其关注的事件
+    struct CIoWatch
+    {
+        uint32_t events;
+        io_callback callback;
+    };
+
+    //队列中的任务及其入队时间
+    struct CQueuedTask
+    {
+        task_type task;
+        clock_type::time_point enqueued;
+    };
+
+    template<class Function, class... Types>
+    std::future<typename std::result_of<Function(Types...)>::type> submit(bool admit, std::chrono::microseconds, Function&&, Types&&...);
+    void enqueue(task_type&& task, bool admit, std::chrono::microseconds deadline);
+    void admitLocked(std::chrono::microseconds deadline);
+    task_type popTaskLocked(bool newest = false);
+    void runTask(task_type& task);
+    void spawnThread();
+    void trySpawnThread();
+    static void initAttr(pthread_attr_t& attr, const CThreadAttr& threadAttr);
+    static void *threadFunc(void *arg);
+    static CThreadpool*& currentPool();
+    void workerLoop();
+    void reactorLoop();
+    void dispatch(int fd, uint32_t events);
+    void wakeReactor();
 private:
     CThreadpool(const CThreadpool& tp) = delete;
     CThreadpool& operator=(const CThreadpool& tp) = delete;
@@ -101,56 +300,453 @@ private:
     std::mutex lock_;
     std::condition_variable notify_;
 
-    std::queue<task_type> taskQueue_;
-    std::vector<std::thread> threadVec_;
+    size_t maxThread_;                              //工作线程数上限
+    size_t idleThread_;                             //正在等待任务的工作线程数
+    CThreadAttr threadAttr_;                        //工作线程属性
+    std::deque<CQueuedTask> taskQueue_;
+
+    std::atomic<int> admission_;                    //AdmissionMode
+    clock_type::duration target_;                   //以下准入控制状态均由lock_保护
+    clock_type::duration interval_;
+    clock_type::time_point firstAbove_;             //逗留时间开始持续超过target_后, 再过interval_的时刻
+    bool overloaded_;                               //kCoDel: 是否正在拒绝新任务
+    std::atomic<int64_t> ewmaRunNs_;                //kPredictive: 任务执行时间的指数加权平均
+    std::atomic<size_t> codelShed_;
+    std::atomic<size_t> deadlineShed_;
+
+    WaitMode mode_;
+    CFdGuard epollFd_;                              //kReactor模式下工作线程共享的epoll
+    CFdGuard wakeFd_;                               //kReactor模式下用于唤醒工作线程的eventfd
+    std::mutex ioLock_;                             //保护ioWatch_
+    std::unordered_map<int, std::shared_ptr<CIoWatch>> ioWatch_;
+
+    std::vector<pthread_t> threadVec_;
     CThreadGuard tg_;
 };
 
-inline CThreadpool::CThreadpool(int num)
-:stop_(false),tg_(threadVec_)
+inline CThreadpool::CThreadpool(int num, const std::string& name, WaitMode mode)
+:CThreadpool(num, [&name]{CThreadAttr attr; attr.name = name; return attr;}(), mode)
+{}
+
+inline CThreadpool::CThreadpool(int num, const CThreadAttr& attr, WaitMode mode)
+:stop_(false),idleThread_(0),threadAttr_(attr),admission_(kAdmitAll),target_(0),interval_(0),
+overloaded_(false),ewmaRunNs_(0),codelShed_(0),deadlineShed_(0),mode_(mode),tg_(threadVec_)
 {
     int nthread = num;
     if(nthread < 0){
         nthread = std::thread::hardware_concurrency();
         nthread = (nthread == 0 ? 2 : nthread);
     }
+    maxThread_ = nthread;
+    threadVec_.reserve(maxThread_);
+
+    //提前检查属性, 而不是等到第一次add时才失败
+    pthread_attr_t pattr;
+    initAttr(pattr, threadAttr_);
+    pthread_attr_destroy(&pattr);
 
-    for(int i = 0; i < nthread; ++i){
-        threadVec_.push_back(std::thread([this]{
-            while(!stop_.load(std::memory_order_acquire)){
-                task_type task;
-                {
-                    std::unique_lock<std::mutex> ulk(this->lock_);
-                    //等待至stop_为true或者队列非空
-                    this->notify_.wait(ulk, [this]{return stop_.load(std::memory_order_acquire) || !this->taskQueue_.empty();});
-                    if(stop_.load(std::memory_order_acquire)){
-                        return;
-                    }
-                    task = std::move(this->taskQueue_.front());
-                    this->taskQueue_.pop();
+    if(mode_ == kReactor){
+        epollFd_.reset(epoll_create1(EPOLL_CLOEXEC));
+        if(epollFd_.get() < 0){
+            throw std::system_error(errno, std::system_category(), "epoll_create1");
+        }
+        //信号量模式: 每次add写1, 每个被唤醒的线程读走1, 计数非0时其余线程仍可被唤醒
+        wakeFd_.reset(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE));
+        if(wakeFd_.get() < 0){
+            throw std::system_error(errno, std::system_category(), "eventfd");
+        }
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = wakeFd_.get();
+        if(epoll_ctl(epollFd_.get(), EPOLL_CTL_ADD, wakeFd_.get(), &ev) < 0){
+            throw std::system_error(errno, std::system_category(), "epoll_ctl");
+        }
+    }
+}
+
+//按threadAttr设置attr, 失败时抛出std::system_error
+inline void CThreadpool::initAttr(pthread_attr_t& attr, const CThreadAttr& threadAttr)
+{
+    int err = pthread_attr_init(&attr);
+    if(err != 0){
+        throw std::system_error(err, std::system_category(), "pthread_attr_init");
+    }
+    if(threadAttr.stackSize != 0 && (err = pthread_attr_setstacksize(&attr, threadAttr.stackSize)) != 0){
+        pthread_attr_destroy(&attr);
+        throw std::system_error(err, std::system_category(), "pthread_attr_setstacksize");
+    }
+    if(threadAttr.guardSize != 0 && (err = pthread_attr_setguardsize(&attr, threadAttr.guardSize)) != 0){
+        pthread_attr_destroy(&attr);
+        throw std::system_error(err, std::system_category(), "pthread_attr_setguardsize");
+    }
+}
+
+inline void *CThreadpool::threadFunc(void *arg)
+{
+    CThreadpool *pool = static_cast<CThreadpool*>(arg);
+    if(pool->mode_ == kReactor){
+        pool->reactorLoop();
+    }else{
+        pool->workerLoop();
+    }
+    return NULL;
+}
+
+//创建一个新的工作线程, 调用时须持有lock_
+inline void CThreadpool::spawnThread()
+{
+    pthread_attr_t attr;
+    initAttr(attr, threadAttr_);
+    pthread_t tid;
+    int err = pthread_create(&tid, &attr, threadFunc, this);
+    pthread_attr_destroy(&attr);
+    if(err != 0){
+        throw std::system_error(err, std::system_category(), "pthread_create");
+    }
+    threadVec_.push_back(tid);
+    if(!threadAttr_.name.empty()){
+        char name[16];
+        snprintf(name, sizeof(name), "%s-%zu", threadAttr_.name.c_str(), threadVec_.size() - 1);
+        pthread_setname_np(tid, name);
+    }
+}
+
+//没有空闲的工作线程时再创建新线程, 创建失败且没有任何工作线程则把异常抛给调用者
+//调用时须持有lock_
+inline void CThreadpool::trySpawnThread()
+{
+    if(taskQueue_.size() >= idleThread_ && threadVec_.size() < maxThread_){
+        try{
+            spawnThread();
+        }catch(const std::system_error&){
+            if(threadVec_.empty()){
+                throw;
+            }
+        }
+    }
+}
+
+//当前线程所属的线程池, 非工作线程为NULL
+inline CThreadpool*& CThreadpool::currentPool()
+{
+    static thread_local CThreadpool *pool = NULL;
+    return pool;
+}
+
+inline void CThreadpool::workerLoop()
+{
+    currentPool() = this;
+    CArena arena;
+    CArena::current() = &arena;
+    while(!stop_.load(std::memory_order_acquire)){
+        task_type task;
+        {
+            std::unique_lock<std::mutex> ulk(this->lock_);
+            //等待至stop_为true或者队列非空
+            ++idleThread_;
+            this->notify_.wait(ulk, [this]{return stop_.load(std::memory_order_acquire) || !this->taskQueue_.empty();});
+            --idleThread_;
+            if(stop_.load(std::memory_order_acquire)){
+                return;
+            }
+            task = popTaskLocked();
+        }
+        runTask(task);
+    }
+}
+
+//kReactor模式的工作线程: 先执行队列中的任务, 队列为空时在epoll上等待fd就绪或eventfd唤醒
+inline void CThreadpool::reactorLoop()
+{
+    currentPool() = this;
+    CArena arena;
+    CArena::current() = &arena;
+    while(!stop_.load(std::memory_order_acquire)){
+        task_type task;
+        {
+            std::lock_guard<std::mutex> lg(lock_);
+            if(!taskQueue_.empty()){
+                task = popTaskLocked();
+            }else{
+                ++idleThread_;
+            }
+        }
+        if(task){
+            runTask(task);
+            continue;
+        }
+
+        //每次只取一个事件, 让就绪的fd尽量分散到各个空闲线程上
+        epoll_event ev;
+        int n = epoll_wait(epollFd_.get(), &ev, 1, -1);
+        {
+            std::lock_guard<std::mutex> lg(lock_);
+            --idleThread_;
+            //取到fd事件而没有其它线程在epoll上等待时补一个线程, 否则只注册fd、不add任务的服务始终只有一个线程
+            if(n > 0 && ev.data.fd != wakeFd_.get() && idleThread_ == 0 && !stop_.load(std::memory_order_acquire)){
+                trySpawnThread();
+            }
+        }
+        //停止时不消费eventfd, 使其保持可读以唤醒其余线程
+        if(n <= 0 || stop_.load(std::memory_order_acquire)){
+            continue;
+        }
+        if(ev.data.fd == wakeFd_.get()){
+            uint64_t cnt;
+            ssize_t ret = read(wakeFd_.get(), &cnt, sizeof(cnt));
+            (void)ret;      //EAGAIN说明已被其它线程读走, 忽略
+        }else{
+            dispatch(ev.data.fd, ev.events);
+        }
+    }
+}
+
+//执行fd的回调, 完成后重新激活该fd(EPOLLONESHOT)
+inline void CThreadpool::dispatch(int fd, uint32_t events)
+{
+    std::shared_ptr<CIoWatch> w;
+    {
+        std::lock_guard<std::mutex> lg(ioLock_);
+        auto iter = ioWatch_.find(fd);
+        if(iter == ioWatch_.end()){
+            return;
+        }
+        w = iter->second;
+    }
+
+    //与runTask一样, 回调中从arena分配的内存在回调结束后回退
+    CArena& arena = *CArena::current();
+    CArena::CMark mark = arena.mark();
+    w->callback(events);
+    arena.rewind(mark);
+
+    std::lock_guard<std::mutex> lg(ioLock_);
+    auto iter = ioWatch_.find(fd);
+    //期间被unwatch或重新watch过则不再激活
+    if(iter != ioWatch_.end() && iter->second == w){
+        epoll_event ev;
+        ev.events = w->events;
+        ev.data.fd = fd;
+        epoll_ctl(epollFd_.get(), EPOLL_CTL_MOD, fd, &ev);
+    }
+}
+
+inline void CThreadpool::wakeReactor()
+{
+    if(wakeFd_.get() >= 0){
+        uint64_t one = 1;
+        ssize_t ret = write(wakeFd_.get(), &one, sizeof(one));
+        (void)ret;          //EAGAIN说明计数已满, 工作线程必然会被唤醒
+    }
+}
+
+/**
+* @function watch
+* @brief register fd to the reactor, cb is called on a worker thread when fd is ready
+* @param fd file descriptor, should be non-blocking when edgeTriggered is true
+* @param events epoll events, such as EPOLLIN, EPOLLOUT
+* @param cb callback called with the ready events
+* @param edgeTriggered use EPOLLET if true, level-triggered otherwise
+*/
+inline void CThreadpool::watch(int fd, uint32_t events, io_callback cb, bool edgeTriggered)
+{
+    if(mode_ != kReactor){
+        throw std::runtime_error("threadpool is not in reactor mode!");
+    }
+    //先检查, 避免抛出异常后fd仍留在epoll中
+    if(stop_.load(std::memory_order_acquire)){
+        throw std::runtime_error("threadpool has stopped!");
+    }
+
+    auto w = std::make_shared<CIoWatch>();
+    w->events = events | EPOLLONESHOT | (edgeTriggered ? EPOLLET : 0);
+    w->callback = std::move(cb);
+    {
+        std::lock_guard<std::mutex> lg(ioLock_);
+        epoll_event ev;
+        ev.events = w->events;
+        ev.data.fd = fd;
+        if(epoll_ctl(epollFd_.get(), EPOLL_CTL_ADD, fd, &ev) < 0){
+            throw std::system_error(errno, std::system_category(), "epoll_ctl");
+        }
+        ioWatch_[fd] = w;
+    }
+
+    //至少要有一个工作线程在epoll上等待
+    std::lock_guard<std::mutex> lg(lock_);
+    trySpawnThread();
+}
+
+/**
+* @function unwatch
+* @brief unregister fd, a callback already running is not interrupted
+* @param fd file descriptor
+*/
+inline void CThreadpool::unwatch(int fd)
+{
+    std::lock_guard<std::mutex> lg(ioLock_);
+    if(ioWatch_.erase(fd) > 0){
+        epoll_ctl(epollFd_.get(), EPOLL_CTL_DEL, fd, NULL);
+    }
+}
+
+inline void CThreadpool::setAdmission(AdmissionMode mode, std::chrono::microseconds target, std::chrono::microseconds interval)
+{
+    std::lock_guard<std::mutex> lg(lock_);
+    target_ = target;
+    interval_ = interval;
+    firstAbove_ = clock_type::time_point();
+    overloaded_ = false;
+    admission_.store(mode, std::memory_order_relaxed);
+}
+
+//准入控制, 拒绝时抛出CTaskRejected, 调用时须持有lock_
+inline void CThreadpool::admitLocked(std::chrono::microseconds deadline)
+{
+    switch(admission_.load(std::memory_order_relaxed)){
+    case kCoDel:
+        if(overloaded_){
+            codelShed_.fetch_add(1, std::memory_order_relaxed);
+            throw CTaskRejected("threadpool is overloaded: queue sojourn time above target!");
+        }
+        break;
+    case kPredictive:
+        {
+            clock_type::duration limit = (deadline.count() < 0 ? target_ : deadline);
+            int64_t waitNs = ewmaRunNs_.load(std::memory_order_relaxed) * taskQueue_.size() / maxThread_;
+            if(std::chrono::nanoseconds(waitNs) > limit){
+                deadlineShed_.fetch_add(1, std::memory_order_relaxed);
+                throw CTaskRejected("threadpool is overloaded: estimated wait exceeds deadline!");
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+//取出队首(newest为true时取队尾)任务并更新CoDel状态, 调用时须持有lock_且队列非空
+inline CThreadpool::task_type CThreadpool::popTaskLocked(bool newest)
+{
+    CQueuedTask& queued = (newest ? taskQueue_.back() : taskQueue_.front());
+    task_type task = std::move(queued.task);
+    clock_type::time_point enqueued = queued.enqueued;
+    if(newest){
+        taskQueue_.pop_back();
+    }else{
+        taskQueue_.pop_front();
+    }
+
+    if(admission_.load(std::memory_order_relaxed) == kCoDel){
+        clock_type::time_point now = clock_type::now();
+        if(now - enqueued < target_ || taskQueue_.empty()){
+            //逗留时间回到target以下或队列已排空, 退出过载状态
+            firstAbove_ = clock_type::time_point();
+            overloaded_ = false;
+        }else if(firstAbove_ == clock_type::time_point()){
+            firstAbove_ = now + interval_;
+        }else if(now >= firstAbove_){
+            overloaded_ = true;
+        }
+    }
+    return task;
+}
+
+//执行任务, 结束后把arena回退到任务开始时的位置(wait中嵌套执行的任务也只回退自己分配的部分)
+inline void CThreadpool::runTask(task_type& task)
+{
+    CArena& arena = *CArena::current();
+    CArena::CMark mark = arena.mark();
+    if(admission_.load(std::memory_order_relaxed) != kPredictive){
+        task();
+        arena.rewind(mark);
+        return;
+    }
+
+    clock_type::time_point start = clock_type::now();
+    task();
+    arena.rewind(mark);
+    int64_t sample = std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - start).count();
+    //alpha = 1/8, 多个线程并发更新时丢失个别样本不影响估计
+    int64_t ewma = ewmaRunNs_.load(std::memory_order_relaxed);
+    ewmaRunNs_.store(ewma == 0 ? sample : ewma + (sample - ewma) / 8, std::memory_order_relaxed);
+}
+
+inline void CThreadpool::enqueue(task_type&& task, bool admit, std::chrono::microseconds deadline)
+{
+    {
+        std::lock_guard<std::mutex> lg(lock_);
+        if(stop_.load(std::memory_order_acquire)){
+            throw std::runtime_error("threadpool has stopped!");
+        }
+        if(admit){
+            admitLocked(deadline);
+        }
+        trySpawnThread();
+
+        //总是记录入队时间, 否则开启kCoDel前已在队列中的任务的逗留时间会从时钟起点算起
+        CQueuedTask queued;
+        queued.task = std::move(task);
+        queued.enqueued = clock_type::now();
+        taskQueue_.push_back(std::move(queued));
+    }
+    if(mode_ == kReactor){
+        wakeReactor();
+    }else{
+        notify_.notify_one();
+    }
+}
+
+template<class T>
+T CThreadpool::wait(std::future<T>& f)
+{
+    if(currentPool() == this){
+        while(f.wait_for(std::chrono::seconds(0)) != std::future_status::ready){
+            task_type task;
+            {
+                std::lock_guard<std::mutex> lg(lock_);
+                if(!taskQueue_.empty()){
+                    task = popTaskLocked(true);
                 }
-                task();
             }
-        }));
+            if(task){
+                runTask(task);
+            }else{
+                //没有可以帮忙的任务, 说明f正由其它工作线程执行, 短暂等待后再检查队列
+                f.wait_for(std::chrono::microseconds(100));
+            }
+        }
     }
+    return f.get();
 }
 
 template<class Function, class... Types>
 std::future<typename std::result_of<Function(Types...)>::type> CThreadpool::add(Function&& fcn, Types&&... args)
+{
+    return add_within(std::chrono::microseconds(-1), std::forward<Function>(fcn), std::forward<Types>(args)...);
+}
+
+template<class Function, class... Types>
+std::future<typename std::result_of<Function(Types...)>::type> CThreadpool::add_within(std::chrono::microseconds deadline, Function&& fcn, Types&&... args)
+{
+    return submit(true, deadline, std::forward<Function>(fcn), std::forward<Types>(args)...);
+}
+
+template<class Function, class... Types>
+std::future<typename std::result_of<Function(Types...)>::type> CThreadpool::add_continuation(Function&& fcn, Types&&... args)
+{
+    return submit(false, std::chrono::microseconds(-1), std::forward<Function>(fcn), std::forward<Types>(args)...);
+}
+
+template<class Function, class... Types>
+std::future<typename std::result_of<Function(Types...)>::type> CThreadpool::submit(bool admit, std::chrono::microseconds deadline, Function&& fcn, Types&&... args)
 {
     typedef typename std::result_of<Function(Types...)>::type return_type;
     typedef std::packaged_task<return_type()> task;
 
     auto t = std::make_shared<task>(std::bind(std::forward<Function>(fcn), std::forward<Types> (args)...));
     auto ret = t->get_future();
-    {
-        std::lock_guard<std::mutex> lg(lock_);
-        if(stop_.load(std::memory_order_acquire)){
-            throw std::runtime_error("threadpool has stopped!");
-        }
-        taskQueue_.emplace([t]{(*t)();});
-    }
-    notify_.notify_one();
+    enqueue([t]{(*t)();}, admit, deadline);
     return ret;
 }
 
@@ -35,6 +35,7 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <malloc.h>
+#include <stdio.h>
 #include <string>
 #include <iostream>
 #include <new>  // std::bad_alloc
@@ -42,10 +43,12 @@
 /**
 * @function CThreadPool
 * @brief CThreadPool's constructor
-* @param num Number of worker threads.
+* @param num Maximum number of worker threads.
+* @param attr Attributes of worker threads.
 * @return 
 */
-CThreadPool::CThreadPool(int num):isRunning_(true), threadNum_(num), threads_(NULL)
+CThreadPool::CThreadPool(int num, const CThreadAttr& attr)
+:isRunning_(true), threadNum_(num), startedNum_(0), idleNum_(0), threads_(NULL), threadAttr_(attr)
 {
     assert(threadNum_ > 0);
 
@@ -72,13 +75,22 @@ CThreadPool::~CThreadPool()
 
 /**
 * @function createThread
-* @brief create threadNum_ worker threads
+* @brief prepare resources for at most threadNum_ worker threads,
+*        the threads themselves are created lazily by addTask
 * @return 0 if succeed, -1 on failed
 */
 int CThreadPool::createThread()
 {
     pthread_mutex_init(&lock_, NULL);
     pthread_cond_init(&notify_, NULL);
+    pthread_attr_init(&attr_);
+
+    if(threadAttr_.stackSize != 0 && pthread_attr_setstacksize(&attr_, threadAttr_.stackSize) != 0){
+        std::cerr << "pthread_attr_setstacksize error! use default stack size" << std::endl;
+    }
+    if(threadAttr_.guardSize != 0 && pthread_attr_setguardsize(&attr_, threadAttr_.guardSize) != 0){
+        std::cerr << "pthread_attr_setguardsize error! use default guard size" << std::endl;
+    }
 
     //threads_ = (pthread_t*)malloc(sizeof(pthread_t) * threadNum_);
     try{
@@ -88,16 +100,34 @@ int CThreadPool::createThread()
 
         pthread_mutex_destroy(&lock_);
         pthread_cond_destroy(&notify_);
+        pthread_attr_destroy(&attr_);
 
         return -1;
     }
 
-    for(int i = 0; i < threadNum_; ++i){
-        if(pthread_create(&threads_[i], NULL, threadFunc, this) != 0){
-            std::cerr << "pthread_create error!" << std::endl;
-            return -1;
-        }
+    return 0;
+}
+
+/**
+* @function spawnThread
+* @brief create one more worker thread, must be called with lock_ held
+* @return 0 if succeed, -1 on failed
+*/
+int CThreadPool::spawnThread()
+{
+    assert(threads_ != NULL && startedNum_ < threadNum_);
+    if(pthread_create(&threads_[startedNum_], &attr_, threadFunc, this) != 0){
+        std::cerr << "pthread_create error!" << std::endl;
+        return -1;
+    }
+
+    if(!threadAttr_.name.empty()){
+        // 线程名最长15字节
+        char name[16];
+        snprintf(name, sizeof(name), "%s-%d", threadAttr_.name.c_str(), startedNum_);
+        pthread_setname_np(threads_[startedNum_], name);
     }
+    ++startedNum_;
 
     return 0;
 }
@@ -130,6 +160,14 @@ int CThreadPool::addTask(CTask *task)
         return -1;
     }
 
+    //没有空闲的工作线程时再创建新线程, 创建失败且没有任何工作线程则拒绝任务
+    if(queue_.size() >= static_cast<size_t>(idleNum_) && startedNum_ < threadNum_){
+        if(spawnThread() < 0 && startedNum_ == 0){
+            pthread_mutex_unlock(&lock_);
+            return -1;
+        }
+    }
+
     //否则继续向线程池添加任务
     queue_.push_back(task);
     //发送消息
@@ -154,7 +192,7 @@ void CThreadPool::stop()
     isRunning_ = false;
     pthread_cond_broadcast(&notify_);
     //thread_join
-    for(int i = 0; i < threadNum_; ++i){
+    for(int i = 0; i < startedNum_; ++i){
         pthread_join(threads_[i], NULL);
     }
 
@@ -164,6 +202,7 @@ void CThreadPool::stop()
 
     pthread_mutex_destroy(&lock_);
     pthread_cond_destroy(&notify_);
+    pthread_attr_destroy(&attr_);
 }
 
 
@@ -177,9 +216,11 @@ CTask* CThreadPool::takeTask()
     CTask * task = NULL;
     while(!task){
         pthread_mutex_lock(&lock_);
+        ++idleNum_;
         while(queue_.empty() && isRunning_){
             pthread_cond_wait(&notify_, &lock_);
         }
+        --idleNum_;
 
         if(!isRunning_){
             pthread_mutex_unlock(&lock_);
@@ -54,11 +54,21 @@ protected:
     std::string taskName_;                                //任务标记
 };
 
-//线程池类
+//工作线程属性, 0或空串表示使用系统默认值
+struct CThreadAttr
+{
+    CThreadAttr():stackSize(0), guardSize(0){}
+
+    size_t stackSize;                               //线程栈大小
+    size_t guardSize;                               //栈溢出保护区大小
+    std::string name;                               //线程名前缀, 实际名为"name-序号", 超过15字节截断
+};
+
+//线程池类, 工作线程在提交任务时按需创建, 最多threadNum_个
 class CThreadPool
 {
 public:
-    explicit CThreadPool(int num = 10);
+    explicit CThreadPool(int num = 10, const CThreadAttr& attr = CThreadAttr());
     ~CThreadPool();
 public:
     size_t size();
@@ -67,6 +77,7 @@ public:
     CTask *takeTask();
 private:
     int createThread();
+    int spawnThread();
     //工作线程
     static void *threadFunc(void *);
 private:
@@ -74,8 +85,12 @@ private:
     CThreadPool(const CThreadPool &);               //Effective C++ Item 6 禁止对象拷贝构造
 private:
     volatile int isRunning_;                        //线程池运行与停止状态
-    int threadNum_;                                 //工作线程数
+    int threadNum_;                                 //工作线程数上限
+    int startedNum_;                                //已创建的工作线程数
+    int idleNum_;                                   //正在等待任务的工作线程数
     pthread_t *threads_;                            //工作线程的pthread_t id, 是一个数组
+    CThreadAttr threadAttr_;                        //工作线程属性
+    pthread_attr_t attr_;                           //由threadAttr_生成的pthread属性
     std::deque<CTask*> queue_;                      //任务队列
     pthread_mutex_t lock_;                          //mutex
     pthread_cond_t notify_;                         //condition